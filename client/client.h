@@ -43,6 +43,9 @@ extern std::string remote_daemon;
 /* in remote.cpp */
 extern std::string get_absfilename(const std::string &_file);
 
+/* In main.cpp.  */
+extern MsgChannel *get_local_daemon();
+
 /* In arg.cpp.  */
 extern bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun,
                          std::list<std::string> *extrafiles);
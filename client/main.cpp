@@ -90,6 +90,8 @@ static void dcc_show_usage(void)
         "                              compiled on multiple hosts to ensure that they're\n"
         "                              producing the same output.  The default is 0.\n"
         "   ICECC_PREFERRED_HOST       overrides scheduler decisions if set.\n"
+        "   ICECC_PRIORITY             [urgent | normal | background] how soon the job should\n"
+        "                              get a compile host, background jobs also run niced.\n"
         "   ICECC_CC                   set C compiler name (default gcc).\n"
         "   ICECC_CXX                  set C++ compiler name (default g++).\n"
         "   ICECC_REMOTE_CPP           set to 1 or 0 to override remote preprocessing\n"
@@ -197,7 +199,7 @@ static int create_native(char **args)
     return 1;
 }
 
-static MsgChannel* get_local_daemon()
+MsgChannel* get_local_daemon()
 {
     MsgChannel* local_daemon;
     if (getenv("ICECC_TEST_SOCKET") == NULL) {
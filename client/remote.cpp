@@ -27,6 +27,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <dirent.h>
 
 
 #ifdef __FreeBSD__
@@ -35,6 +36,7 @@
 #endif
 
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <limits.h>
 #include <assert.h>
@@ -46,6 +48,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <vector>
+#include <fstream>
+#include <iterator>
 
 #include <comm.h>
 #include "client.h"
@@ -69,6 +73,9 @@ struct CharBufferDeleter {
     }
 };
 
+// Thrown when the other compile of a duplicated job got its result first.
+struct ResultClaimed {};
+
 }
 
 using namespace std;
@@ -227,10 +234,143 @@ get_absfilename(const string &_file)
     return file;
 }
 
+/* Compression dictionaries are cached in the user's temp directory, named
+   by their id, so that the local daemon passes each one only once and not
+   with every job. The scheduler trains new ones only rarely, at most
+   MAX_CACHED_DICTS are kept.  */
+
+static string dict_cache_dir()
+{
+    string dir = user_temp_dir();
+
+    if (dir.empty()) {
+        return dir;
+    }
+
+    dir += "/dicts";
+
+    if (mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+        log_perror("mkdir") << "\t" << dir << endl;
+        return string();
+    }
+
+    return dir;
+}
+
+static string dict_cache_file(const string &dir, uint32_t dict_id)
+{
+    char buffer[16];
+    sprintf(buffer, "/%u", dict_id);
+    return dir + buffer;
+}
+
+static list<uint32_t> cached_dict_ids()
+{
+    list<uint32_t> ids;
+    string dir = dict_cache_dir();
+    DIR *d = dir.empty() ? 0 : opendir(dir.c_str());
+
+    if (!d) {
+        return ids;
+    }
+
+    while (struct dirent *ent = readdir(d)) {
+        char *end;
+        unsigned long dict_id = strtoul(ent->d_name, &end, 10);
+
+        if (dict_id && !*end) {
+            ids.push_back(dict_id);
+        }
+    }
+
+    closedir(d);
+    return ids;
+}
+
+// Makes the cached dictionary DICT_ID known, returns false if there is none.
+static bool load_cached_dict(uint32_t dict_id)
+{
+    if (!dict_id || CompressionDicts::has(dict_id)) {
+        return CompressionDicts::has(dict_id);
+    }
+
+    string dir = dict_cache_dir();
+
+    if (dir.empty()) {
+        return false;
+    }
+
+    ifstream file(dict_cache_file(dir, dict_id).c_str(), ios::binary);
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    return !data.empty() && CompressionDicts::add(data) == dict_id;
+}
+
+// Adds a dictionary the local daemon sent and caches it for later jobs.
+static void add_dict(const string &data)
+{
+    uint32_t dict_id = CompressionDicts::add(data);
+    string dir = dict_id ? dict_cache_dir() : string();
+
+    if (dir.empty()) {
+        return;
+    }
+
+    string path = dict_cache_file(dir, dict_id);
+    char suffix[32];
+    sprintf(suffix, ".%d.tmp", (int)getpid());
+    string tmp = path + suffix;
+
+    {
+        ofstream file(tmp.c_str(), ios::binary);
+        file.write(data.data(), data.size());
+
+        if (!file) {
+            unlink(tmp.c_str());
+            return;
+        }
+    }
+
+    if (rename(tmp.c_str(), path.c_str())) {
+        unlink(tmp.c_str());
+        return;
+    }
+
+    list<uint32_t> ids = cached_dict_ids();
+
+    while (ids.size() > MAX_CACHED_DICTS) {
+        list<uint32_t>::iterator oldest = ids.end();
+        time_t oldest_time = 0;
+
+        for (list<uint32_t>::iterator it = ids.begin(); it != ids.end(); ++it) {
+            struct stat st;
+
+            if (*it != dict_id && !stat(dict_cache_file(dir, *it).c_str(), &st)
+                    && (oldest == ids.end() || st.st_mtime < oldest_time)) {
+                oldest = it;
+                oldest_time = st.st_mtime;
+            }
+        }
+
+        if (oldest == ids.end()) {
+            break;
+        }
+
+        unlink(dict_cache_file(dir, *oldest).c_str());
+        ids.erase(oldest);
+    }
+}
+
 static UseCSMsg *get_server(MsgChannel *local_daemon)
 {
     Msg *umsg = local_daemon->get_msg(4 * 60);
 
+    // compression dictionaries the compile server has may come first
+    while (umsg && umsg->type == M_COMPRESSION_DICT) {
+        add_dict(static_cast<CompressionDictMsg *>(umsg)->data);
+        delete umsg;
+        umsg = local_daemon->get_msg(4 * 60);
+    }
+
     if (!umsg || umsg->type != M_USE_CS) {
         log_warning() << "reply was not expected use_cs " << (umsg ? (char)umsg->type : '0')  << endl;
         ostringstream unexpected_msg;
@@ -243,6 +383,315 @@ static UseCSMsg *get_server(MsgChannel *local_daemon)
     return usecs;
 }
 
+/* The scheduler may start a speculative duplicate of a job that takes much
+   longer than expected while other compile servers are idle. The client
+   compiles the duplicate in a child process into a temporary output file.
+   Whichever of the two compiles gets its result first takes the token from
+   the pipe, the other one gives up. The child has its own connection to
+   the local daemon and exits with EXIT_DISTCC_FAILED if it fails.  */
+struct Duplicate {
+    Duplicate()
+        : job(0)
+        , version_map(0)
+        , versionfile_map(0)
+        , pid(-1)
+        , exited_fd(-1)
+        , claimed(false)
+    {
+        token[0] = token[1] = -1;
+    }
+
+    CompileJob *job; // the job that may be duplicated, 0 if none
+    const map<string, string> *version_map;
+    const map<string, string> *versionfile_map;
+    pid_t pid; // of the child compiling the duplicate, -1 if none
+    int exited_fd; // at EOF once the child exited
+    int token[2];
+    bool claimed; // this process took the token
+    string output; // the object file of the duplicate
+};
+
+static Duplicate duplicate;
+
+/* Returns false if the other compile of a duplicated job has taken the
+   result already.  */
+static bool claim_result()
+{
+    if (duplicate.token[0] < 0 || duplicate.claimed) {
+        return true;
+    }
+
+    char c;
+
+    if (read(duplicate.token[0], &c, 1) == 1) {
+        duplicate.claimed = true;
+        return true;
+    }
+
+    return false;
+}
+
+static void remove_duplicate_output()
+{
+    if (duplicate.output.empty()) {
+        return;
+    }
+
+    if (-1 == ::unlink(duplicate.output.c_str()) && errno != ENOENT) {
+        log_perror("unlink failed") << "\t" << duplicate.output << endl;
+    }
+
+    if (duplicate.job->dwarfFissionEnabled()) {
+        string dwo_file = duplicate.output.substr(0, duplicate.output.rfind('.')) + ".dwo";
+
+        if (-1 == ::unlink(dwo_file.c_str()) && errno != ENOENT) {
+            log_perror("unlink failed") << "\t" << dwo_file << endl;
+        }
+    }
+
+    duplicate.output.clear();
+}
+
+static void reap_duplicate(int *status)
+{
+    *status = -1;
+
+    while (waitpid(duplicate.pid, status, 0) < 0 && errno == EINTR) {}
+
+    if (-1 == close(duplicate.exited_fd)) {
+        log_perror("close failed");
+    }
+
+    duplicate.pid = -1;
+    duplicate.exited_fd = -1;
+}
+
+static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
+                            const string &environment, const string &version_file,
+                            const char *preproc_file, bool output);
+
+static void start_duplicate(UseCSMsg *usecs, MsgChannel *local_daemon)
+{
+    map<string, string>::const_iterator environment = duplicate.version_map->find(usecs->host_platform);
+    map<string, string>::const_iterator version_file = duplicate.versionfile_map->find(usecs->host_platform);
+
+    if (environment == duplicate.version_map->end() || version_file == duplicate.versionfile_map->end()) {
+        log_warning() << "no environment for the duplicate on " << usecs->host_platform << endl;
+        return;
+    }
+
+    if (duplicate.token[0] < 0) {
+        if (pipe(duplicate.token) != 0) {
+            log_perror("pipe failed");
+            return;
+        }
+
+        fcntl(duplicate.token[0], F_SETFL, O_NONBLOCK);
+        ignore_result(write(duplicate.token[1], "t", 1));
+    }
+
+    int exited[2];
+
+    if (pipe(exited) != 0) {
+        log_perror("pipe failed");
+        return;
+    }
+
+    char *buffer = 0;
+    dcc_make_tmpnam("icecc", ".o", &buffer, 0);
+    const CharBufferDeleter buffer_holder(buffer);
+    CompileJob job = *duplicate.job;
+    job.setOutputFile(buffer);
+    duplicate.output = buffer;
+
+    log_info() << "compiling a duplicate of the job on " << usecs->hostname << endl;
+    flush_debug();
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("failure of fork");
+        close(exited[0]);
+        close(exited[1]);
+        remove_duplicate_output();
+        return;
+    }
+
+    if (!pid) {
+        close(exited[0]);
+        // the parent keeps reading its own channel
+        close(local_daemon->fd);
+        duplicate.job = 0;
+        int ret = EXIT_DISTCC_FAILED;
+        MsgChannel *daemon = get_local_daemon();
+
+        if (!daemon) {
+            log_info() << "the duplicate can't reach the local daemon" << endl;
+            _exit(ret);
+        }
+
+        try {
+            ret = build_remote_int(job, usecs, daemon, environment->second,
+                                   version_file->second, 0, true);
+        } catch (ResultClaimed &) {
+            ret = EXIT_DISTCC_FAILED;
+        } catch (std::exception &error) {
+            log_info() << "compiling the duplicate failed: " << error.what() << endl;
+            ret = EXIT_DISTCC_FAILED;
+        }
+
+        _exit(ret);
+    }
+
+    close(exited[1]);
+    duplicate.pid = pid;
+    duplicate.exited_fd = exited[0];
+}
+
+/* Waits for the result of CSERVER. If the job may be duplicated, messages
+   from the local daemon are handled meanwhile, for the compile server of
+   a duplicate. Throws ResultClaimed if the duplicate got its result first.  */
+static Msg *wait_for_result(MsgChannel *cserver, MsgChannel *local_daemon)
+{
+    if (!duplicate.job) {
+        return cserver->get_msg(12 * 60);
+    }
+
+    time_t deadline = time(0) + 12 * 60;
+    bool daemon_open = true;
+
+    for (;;) {
+        if (cserver->has_msg()) {
+            return cserver->get_msg(0);
+        }
+
+        if (daemon_open && local_daemon->has_msg()) {
+            Msg *msg = local_daemon->get_msg(0, true);
+
+            if (!msg) {
+                daemon_open = false;
+            } else if (msg->type == M_COMPRESSION_DICT) {
+                add_dict(static_cast<CompressionDictMsg *>(msg)->data);
+            } else if (msg->type == M_USE_CS && duplicate.pid == -1) {
+                start_duplicate(static_cast<UseCSMsg *>(msg), local_daemon);
+            }
+
+            delete msg;
+            continue;
+        }
+
+        time_t timeout = deadline - time(0);
+
+        if (timeout <= 0) {
+            return 0;
+        }
+
+        pollfd pfd[3];
+        int nfds = 0;
+        pfd[nfds].fd = cserver->fd;
+        pfd[nfds++].events = POLLIN;
+
+        if (daemon_open) {
+            pfd[nfds].fd = local_daemon->fd;
+            pfd[nfds++].events = POLLIN;
+        }
+
+        if (duplicate.pid != -1) {
+            pfd[nfds].fd = duplicate.exited_fd;
+            pfd[nfds++].events = POLLIN;
+        }
+
+        int ready = poll(pfd, nfds, timeout * 1000);
+
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ready <= 0) {
+            return 0;
+        }
+
+        if (pfd[0].revents && !cserver->read_a_bit()) {
+            return 0;
+        }
+
+        if (daemon_open && pfd[1].revents && !local_daemon->read_a_bit()) {
+            daemon_open = false;
+        }
+
+        if (duplicate.pid != -1 && pfd[nfds - 1].revents) {
+            if (!claim_result()) {
+                // cancel the compile of this process
+                cserver->send_msg(EndMsg());
+                throw ResultClaimed();
+            }
+
+            int status;
+            reap_duplicate(&status);
+            remove_duplicate_output();
+            log_info() << "the duplicate of the job failed" << endl;
+        }
+    }
+}
+
+/* The duplicate got its result first, use it instead of the own one.  */
+static int take_duplicate_result(CompileJob &job)
+{
+    int status;
+    reap_duplicate(&status);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == EXIT_DISTCC_FAILED) {
+        remove_duplicate_output();
+        throw client_error(28, "Error 28 - the duplicate of the job failed");
+    }
+
+    log_info() << "the duplicate of the job was faster" << endl;
+
+    if (WEXITSTATUS(status) == 0) {
+        if (rename(duplicate.output.c_str(), job.outputFile().c_str()) != 0) {
+            log_perror("rename failed") << "\t" << duplicate.output << endl;
+            remove_duplicate_output();
+            throw client_error(28, "Error 28 - the duplicate of the job failed");
+        }
+
+        if (job.dwarfFissionEnabled()) {
+            string dwo_file = duplicate.output.substr(0, duplicate.output.rfind('.')) + ".dwo";
+            string dwo_output = job.outputFile().substr(0, job.outputFile().rfind('.')) + ".dwo";
+
+            if (rename(dwo_file.c_str(), dwo_output.c_str()) != 0) {
+                log_perror("rename failed") << "\t" << dwo_file << endl;
+            }
+        }
+
+        duplicate.output.clear();
+    }
+
+    remove_duplicate_output();
+    return WEXITSTATUS(status);
+}
+
+/* Stops the duplicate if it still runs and forgets about it.  */
+static void end_duplicate()
+{
+    if (duplicate.pid != -1) {
+        int status;
+        kill(duplicate.pid, SIGTERM);
+        reap_duplicate(&status);
+    }
+
+    if (duplicate.job) {
+        remove_duplicate_output();
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (duplicate.token[i] >= 0 && -1 == close(duplicate.token[i])) {
+            log_perror("close failed");
+        }
+    }
+
+    duplicate = Duplicate();
+}
+
 static void check_for_failure(Msg *msg, MsgChannel *cserver)
 {
     if (msg && msg->type == M_STATUS_TEXT) {
@@ -253,18 +702,30 @@ static void check_for_failure(Msg *msg, MsgChannel *cserver)
     }
 }
 
+// the read buffer starts at this size and doubles up to a chunk as data comes in
+static const size_t MIN_READ_BUFFER = 64 * 1024;
+
+/* Sends what there is whenever a read comes back short, that is when cpp
+   hasn't written more yet, so that sending overlaps with preprocessing.  */
 static void write_fd_to_server(int fd, MsgChannel *cserver)
 {
-    unsigned char buffer[100000]; // some random but huge number
-    off_t offset = 0;
+    static vector<unsigned char> buffer;
+    const size_t chunk_size = cserver->max_chunk_size();
+    size_t offset = 0;
     size_t uncompressed = 0;
     size_t compressed = 0;
 
     do {
         ssize_t bytes;
 
+        if (offset == buffer.size() && buffer.size() < chunk_size) {
+            buffer.resize(min(chunk_size, max(2 * buffer.size(), MIN_READ_BUFFER)));
+        }
+
+        size_t wanted = min(buffer.size(), chunk_size) - offset;
+
         do {
-            bytes = read(fd, buffer + offset, sizeof(buffer) - offset);
+            bytes = read(fd, &buffer[offset], wanted);
 
             if (bytes < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
                 continue;
@@ -281,9 +742,9 @@ static void write_fd_to_server(int fd, MsgChannel *cserver)
 
         offset += bytes;
 
-        if (!bytes || offset == sizeof(buffer)) {
+        if (!bytes || offset == chunk_size || size_t(bytes) < wanted) {
             if (offset) {
-                FileChunkMsg fcmsg(buffer, offset);
+                FileChunkMsg fcmsg(&buffer[0], offset);
 
                 if (!cserver->send_msg(fcmsg)) {
                     Msg *m = cserver->get_msg(2);
@@ -309,13 +770,160 @@ static void write_fd_to_server(int fd, MsgChannel *cserver)
 
     if (compressed)
         trace() << "sent " << compressed << " bytes (" << (compressed * 100 / uncompressed) <<
-                "%)" << endl;
+                "%, " << cserver->compression_info() << ")" << endl;
 
     if ((-1 == close(fd)) && (errno != EBADF)){
         log_perror("close failed");
     }
 }
 
+/* Environment tarballs are usually compressed already, compressing them again
+   would only burn CPU, so send them stored and without copying them through
+   user space.  */
+static bool send_env_stored(const string &version_file, MsgChannel *cserver)
+{
+    static const char *suffs[] = { ".tar.xz", ".tar.zst", ".tar.bz2", ".tar.gz", ".tgz", NULL };
+    string dummy;
+
+    if (!IS_PROTOCOL_45(cserver)) {
+        return false;
+    }
+
+    for (int i = 0; suffs[i] != NULL; i++)
+        if (endswith(version_file, suffs[i], dummy)) {
+            return true;
+        }
+
+    return false;
+}
+
+static void write_env_stored_to_server(int fd, off_t size, MsgChannel *cserver)
+{
+    const off_t chunk_size = cserver->max_chunk_size();
+    off_t offset = 0;
+
+    while (offset < size) {
+        size_t len = min(size - offset, chunk_size);
+
+        if (!cserver->send_stored_file_chunk(fd, len)) {
+            Msg *m = cserver->get_msg(2);
+            check_for_failure(m, cserver);
+
+            log_error() << "write of environment chunk to host "
+                        << cserver->name.c_str() << endl;
+            close(fd);
+            throw client_error(15, "Error 15 - write to host failed");
+        }
+
+        offset += len;
+    }
+
+    trace() << "sent " << size << " bytes (stored)" << endl;
+
+    if ((-1 == close(fd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+}
+
+/* The scheduler may ask the client to send an environment that many jobs
+   needed lately to an idle compile server as well, so that the server has
+   it before the jobs come. That is done by a detached process, neither the
+   compile nor make wait for it.  */
+static void seed_environment(const CompileJob &job, const UseCSMsg *usecs, MsgChannel *local_daemon,
+                             const map<string, string> &version_map,
+                             const map<string, string> &versionfile_map)
+{
+    if (!usecs->seed_port) {
+        return;
+    }
+
+    map<string, string>::const_iterator version = version_map.find(usecs->seed_platform);
+    map<string, string>::const_iterator version_file = versionfile_map.find(usecs->seed_platform);
+
+    if (version == version_map.end() || version_file == versionfile_map.end()) {
+        return;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork for seeding environment");
+        return;
+    }
+
+    if (pid) {
+        while (waitpid(pid, 0, 0) < 0 && errno == EINTR)
+            ;
+        return;
+    }
+
+    if (fork() != 0) {
+        _exit(0);
+    }
+
+    setsid();
+    close(local_daemon->fd);
+
+    int null_fd = open("/dev/null", O_RDWR);
+
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+
+    MsgChannel *cserver = 0;
+
+    try {
+        struct stat buf;
+        int env_fd = -1;
+
+        cserver = Service::createChannel(usecs->seed_host, usecs->seed_port, 10, true);
+
+        if (cserver && stat(version_file->second.c_str(), &buf) == 0
+                && (env_fd = open(version_file->second.c_str(), O_RDONLY)) >= 0) {
+            trace() << "seeding " << version->second << " to " << usecs->seed_host << endl;
+
+            if (!cserver->send_msg(EnvTransferMsg(job.targetPlatform(), version->second))) {
+                throw client_error(6, "Error 6 - send environment to remote failed");
+            }
+
+            if (send_env_stored(version_file->second, cserver)) {
+                write_env_stored_to_server(env_fd, buf.st_size, cserver);
+            } else {
+                write_fd_to_server(env_fd, cserver);
+            }
+
+            if (!cserver->send_msg(EndMsg())) {
+                throw client_error(8, "Error 8 - write environment to remote failed");
+            }
+
+            if (IS_PROTOCOL_31(cserver)
+                    && cserver->send_msg(VerifyEnvMsg(job.targetPlatform(), version->second))) {
+                Msg *verify_msg = cserver->get_msg(60);
+
+                if (!verify_msg || verify_msg->type != M_VERIFY_ENV_RESULT
+                        || !static_cast<VerifyEnvResultMsg *>(verify_msg)->ok) {
+                    log_warning() << "Host " << usecs->seed_host << " did not verify seeded environment "
+                                  << version->second << endl;
+                }
+
+                delete verify_msg;
+            }
+
+            cserver->send_msg(EndMsg());
+        }
+    } catch (std::exception &error) {
+        log_warning() << "seeding environment to " << usecs->seed_host << " failed: "
+                      << error.what() << endl;
+    }
+
+    delete cserver;
+    _exit(0);
+}
+
 static void receive_file(const string& output_file, MsgChannel* cserver)
 {
     string tmp_file = output_file + "_icetmp";
@@ -401,6 +1009,8 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
     bool got_env = usecs->got_env;
     job.setJobID(job_id);
     job.setEnvironmentVersion(environment);   // hoping on the scheduler's wisdom
+    job.setExpectedMemory(usecs->expected_memory);
+    job.setEnvInstalling(usecs->env_installing);
     trace() << "Have to use host " << hostname << ":" << port << " - Job ID: "
             << job.jobID() << " - env: " << usecs->host_platform
             << " - has env: " << (got_env ? "true" : "false")
@@ -412,7 +1022,7 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
     MsgChannel *cserver = 0;
 
     try {
-        cserver = Service::createChannel(hostname, port, 10);
+        cserver = Service::createChannel(hostname, port, 10, true);
 
         if (!cserver) {
             log_error() << "no server found behind given hostname " << hostname << ":"
@@ -442,7 +1052,11 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                 throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
             }
 
-            write_fd_to_server(env_fd, cserver);
+            if (send_env_stored(version_file, cserver)) {
+                write_env_stored_to_server(env_fd, buf.st_size, cserver);
+            } else {
+                write_fd_to_server(env_fd, cserver);
+            }
 
             if (!cserver->send_msg(EndMsg())) {
                 log_error() << "write of environment failed" << endl;
@@ -495,6 +1109,25 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         }
 
         CompileFileMsg compile_file(&job);
+
+        if (usecs->compression_level) {
+            cserver->set_compression_level(usecs->compression_level);
+        }
+
+        if (IS_PROTOCOL_44(cserver)) {
+            if (load_cached_dict(usecs->source_dict_id)) {
+                cserver->set_compression_dict(usecs->source_dict_id);
+            }
+
+            if (load_cached_dict(usecs->object_dict_id)) {
+                compile_file.output_dict_id = usecs->object_dict_id;
+            }
+        }
+
+        // Queue the job, the source and the end marker, so that for a small
+        // source all of it goes to the remote in one write.
+        cserver->cork();
+
         {
             log_block b("send compile_file");
 
@@ -565,7 +1198,7 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             write_fd_to_server(cpp_fd, cserver);
         }
 
-        if (!cserver->send_msg(EndMsg())) {
+        if (!cserver->send_msg(EndMsg()) || !cserver->uncork()) {
             log_info() << "write of end failed" << endl;
             throw client_error(12, "Error 12 - failed to send file to remote");
         }
@@ -573,7 +1206,7 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         Msg *msg;
         {
             log_block wait_cs("wait for cs");
-            msg = cserver->get_msg(12 * 60);
+            msg = wait_for_result(cserver, local_daemon);
 
             if (!msg) {
                 throw client_error(14, "Error 14 - error reading message from remote");
@@ -599,6 +1232,17 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             throw remote_error(101, "Error 101 - the server ran out of memory, recompiling locally");
         }
 
+        // the other compile of a duplicated job may have its result already
+        if (!claim_result()) {
+            delete crmsg;
+            throw ResultClaimed();
+        }
+
+        // the daemon keeps the level for the next client
+        if (IS_PROTOCOL_53(local_daemon)) {
+            local_daemon->send_msg(CompressionLevelMsg(hostname, max(cserver->compression_level(), 1)));
+        }
+
         if (output) {
             if ((!crmsg->out.empty() || !crmsg->err.empty()) && output_needs_workaround(job)) {
                 delete crmsg;
@@ -750,6 +1394,11 @@ maybe_build_local(MsgChannel *local_daemon, UseCSMsg *usecs, CompileJob &job,
         msg.user_msec = ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
         msg.sys_msec = ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000;
         msg.pfaults = ru.ru_majflt + ru.ru_minflt + ru.ru_nswap;
+#ifdef __APPLE__
+        msg.peak_rss = ru.ru_maxrss / 1024;
+#else
+        msg.peak_rss = ru.ru_maxrss;
+#endif
         msg.exitcode = ret;
 
         if (msg.user_msec > 50 && msg.out_uncompressed > 1024) {
@@ -789,6 +1438,41 @@ static unsigned int requiredRemoteFeatures()
     return features;
 }
 
+/* Size of the largest of the environment tarballs, the scheduler weighs
+   that against compiling where the environment is installed already.  */
+static uint32_t environmentSize(const map<string, string> &versionfile_map)
+{
+    uint32_t size = 0;
+
+    for (map<string, string>::const_iterator it = versionfile_map.begin(); it != versionfile_map.end(); ++it) {
+        struct stat st;
+
+        if (stat(it->second.c_str(), &st) == 0) {
+            size = max(size, st.st_size > off_t(0xffffffff) ? 0xffffffffu : uint32_t(st.st_size));
+        }
+    }
+
+    return size;
+}
+
+static CompileJob::Priority jobPriority()
+{
+    const char *priority = getenv("ICECC_PRIORITY");
+
+    if (!priority || !*priority || strcmp(priority, "normal") == 0) {
+        return CompileJob::Priority_Normal;
+    }
+    if (strcmp(priority, "urgent") == 0) {
+        return CompileJob::Priority_Urgent;
+    }
+    if (strcmp(priority, "background") == 0) {
+        return CompileJob::Priority_Background;
+    }
+
+    log_warning() << "unknown ICECC_PRIORITY " << priority << ", using normal" << endl;
+    return CompileJob::Priority_Normal;
+}
+
 int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs, int permill)
 {
     srand(time(0) + getpid());
@@ -819,6 +1503,7 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
     }
 
     const char *preferred_host = getenv("ICECC_PREFERRED_HOST");
+    job.setPriority(jobPriority());
 
     if (torepeat == 1) {
         string fake_filename;
@@ -840,6 +1525,10 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
                        minimalRemoteVersion(job), requiredRemoteFeatures());
+        getcs.flags |= GetCSMsg::AcceptsDuplicates;
+        getcs.priority = job.priority();
+        getcs.env_size = environmentSize(versionfile_map);
+        getcs.dict_ids = cached_dict_ids();
 
         trace() << "asking for host to use" << endl;
         if (!local_daemon->send_msg(getcs)) {
@@ -850,17 +1539,29 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
         UseCSMsg *usecs = get_server(local_daemon);
         int ret;
 
+        seed_environment(job, usecs, local_daemon, version_map, versionfile_map);
+
+        duplicate.job = &job;
+        duplicate.version_map = &version_map;
+        duplicate.versionfile_map = &versionfile_map;
+
         try {
-            if (!maybe_build_local(local_daemon, usecs, job, ret))
-                ret = build_remote_int(job, usecs, local_daemon,
-                                       version_map[usecs->host_platform],
-                                       versionfile_map[usecs->host_platform],
-                                       0, true);
+            try {
+                if (!maybe_build_local(local_daemon, usecs, job, ret))
+                    ret = build_remote_int(job, usecs, local_daemon,
+                                           version_map[usecs->host_platform],
+                                           versionfile_map[usecs->host_platform],
+                                           0, true);
+            } catch (ResultClaimed &) {
+                ret = take_duplicate_result(job);
+            }
         } catch(...) {
+            end_duplicate();
             delete usecs;
             throw;
         }
 
+        end_duplicate();
         delete usecs;
         return ret;
     } else {
@@ -902,7 +1603,9 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
                        minimalRemoteVersion(job), 0);
-
+        getcs.priority = job.priority();
+        getcs.env_size = environmentSize(versionfile_map);
+        getcs.dict_ids = cached_dict_ids();
 
         if (!local_daemon->send_msg(getcs)) {
             log_warning() << "asked for CS" << endl;
@@ -935,6 +1638,7 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
             const CharBufferDeleter buffer_holder(buffer);
 
             umsgs[i] = get_server(local_daemon);
+            seed_environment(job, umsgs[i], local_daemon, version_map, versionfile_map);
 
             remote_daemon = umsgs[i]->hostname;
 
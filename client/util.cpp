@@ -163,10 +163,8 @@ static bool dcc_open_lockfile(const string &fname, int &plockfd)
 
 static bool dcc_lock_host_slot(string fname, int lock, bool block);
 
-bool dcc_lock_host()
+string user_temp_dir()
 {
-    assert(lock_fd == -1);
-
     string fname = "/tmp/.icecream-";
     struct passwd *pwd = getpwuid(getuid());
 
@@ -180,6 +178,19 @@ bool dcc_lock_host()
 
     if (mkdir(fname.c_str(), 0700) && errno != EEXIST) {
         log_perror("mkdir") << "\t" << fname << endl;
+        return string();
+    }
+
+    return fname;
+}
+
+bool dcc_lock_host()
+{
+    assert(lock_fd == -1);
+
+    string fname = user_temp_dir();
+
+    if (fname.empty()) {
         return false;
     }
 
@@ -42,6 +42,9 @@ extern int resolve_link(const std::string &file, std::string &resolved);
 extern std::string get_cwd();
 extern std::string read_command_output(const std::string& command);
 
+// per-user directory in /tmp, created if needed, empty if that fails
+extern std::string user_temp_dir();
+
 extern bool dcc_lock_host();
 extern void dcc_unlock();
 extern int dcc_locked_fd();
@@ -155,10 +155,14 @@ public:
                 } status;
     Client() {
         job_id = 0;
+        duplicate_job_id = 0;
         channel = 0;
         job = 0;
         usecsmsg = 0;
+        duplicate_usecsmsg = 0;
         client_id = 0;
+        accepts_duplicates = false;
+        compile_requested = 0;
         status = UNKNOWN;
         pipe_from_child = -1;
         pipe_to_child = -1;
@@ -205,6 +209,8 @@ public:
         channel = 0;
         delete usecsmsg;
         usecsmsg = 0;
+        delete duplicate_usecsmsg;
+        duplicate_usecsmsg = 0;
         delete job;
         job = 0;
 
@@ -234,6 +240,12 @@ public:
     UseCSMsg *usecsmsg;
     CompileJob *job;
     int client_id;
+    // the job may be duplicated while it compiles, see GetCSMsg::AcceptsDuplicates
+    bool accepts_duplicates;
+    uint32_t duplicate_job_id; // scheduler job of the duplicate, if any
+    UseCSMsg *duplicate_usecsmsg;
+    list<uint32_t> dict_ids; // compression dictionaries the client has cached
+    time_t compile_requested; // when it became TOCOMPILE
     // pipe from child process with end status, only valid if WAITFORCHILD or TOINSTALL/WAITINSTALL
     int pipe_from_child;
     // pipe to child process, only valid if TOINSTALL/WAITINSTALL
@@ -263,6 +275,10 @@ public:
                     jobs = " CompileServer: " + usecsmsg->hostname;
                 }
 
+                if (duplicate_usecsmsg) {
+                    jobs += " Duplicate: " + toString(duplicate_job_id) + " on " + duplicate_usecsmsg->hostname;
+                }
+
                 return ret + " ClientID: " + toString(client_id) + " Job ID: " + toString(job_id) + jobs;
             } else {
                 return ret + " ClientID: " + toString(client_id);
@@ -358,6 +374,38 @@ public:
             }
         }
 
+        return client;
+    }
+    /* Like get_earliest_client(), but of the clients with a job the one
+       with the most urgent job is taken first. The clients in HELD are
+       left waiting.  */
+    Client *get_most_urgent_client(Client::Status s, const set<Client *> &held) const {
+        Client *client = 0;
+
+        for (const_iterator it = begin(); it != end(); ++it) {
+            Client *c = it->second;
+
+            if (c->status != s) {
+                continue;
+            }
+
+            if (held.count(c)) {
+                continue;
+            }
+
+            if (!client) {
+                client = c;
+                continue;
+            }
+
+            int priority = c->job ? c->job->priority() : CompileJob::Priority_Normal;
+            int best = client->job ? client->job->priority() : CompileJob::Priority_Normal;
+
+            if (priority > best || (priority == best && c->client_id < client->client_id)) {
+                client = c;
+            }
+        }
+
         return client;
     }
 };
@@ -477,6 +525,23 @@ int mem_limit = 100;
 // Minimum rlimit for a compile job, measured in megabytes.
 const int min_mem_limit = 100;
 
+// Free memory at the last stats, in megabytes.
+int free_mem = 0;
+
+/* The compiler reserves more address space than it keeps resident, the
+   rlimit for a job the scheduler expects to need some memory is this
+   many times that.  */
+const int expected_mem_factor = 2;
+
+/* The rlimit for JOB in megabytes. Jobs the scheduler knows to need more
+   than the usual share of the free memory get more, as far as it's free;
+   the scheduler only sends them where it is.  */
+static int job_mem_limit(const CompileJob *job)
+{
+    int expected = int(uint64_t(job->expectedMemory()) * expected_mem_factor / 1024);
+    return std::max(mem_limit, std::min(expected, free_mem));
+}
+
 unsigned int max_kids = 0;
 
 size_t cache_size_limit = 256 * 1024 * 1024;
@@ -495,6 +560,8 @@ struct NativeEnvironment {
 struct Daemon {
     Clients clients;
     map<string, time_t> envs_last_use;
+    // zstd levels clients reached sending to compile servers, by host
+    map<string, int> compression_levels;
     // Map of native environments, the basic one(s) containing just the compiler
     // and possibly more containing additional files (such as compiler plugins).
     // The key is the compiler name and a concatenated list of the additional files
@@ -519,6 +586,7 @@ struct Daemon {
     unsigned long icecream_load;
     struct timeval icecream_usage;
     int current_load;
+    int current_free_mem; // as last sent to the scheduler
     int num_cpus;
     MsgChannel *scheduler;
     DiscoverSched *discover;
@@ -532,6 +600,8 @@ struct Daemon {
     int max_scheduler_pong;
     int max_scheduler_ping;
     unsigned int current_kids;
+    // handle_old_request() left jobs waiting for a transfer that hasn't started
+    bool jobs_held;
 
     Daemon() {
         warn_icecc_user_errno = 0;
@@ -568,6 +638,7 @@ struct Daemon {
         icecream_load = 0;
         icecream_usage.tv_sec = icecream_usage.tv_usec = 0;
         current_load = - 1000;
+        current_free_mem = 0;
         num_cpus = 0;
         scheduler = 0;
         discover = 0;
@@ -577,6 +648,7 @@ struct Daemon {
         max_scheduler_pong = MAX_SCHEDULER_PONG;
         max_scheduler_ping = MAX_SCHEDULER_PING;
         current_kids = 0;
+        jobs_held = false;
     }
 
     ~Daemon() {
@@ -591,6 +663,7 @@ struct Daemon {
     bool handle_get_native_env(Client *client, GetNativeEnvMsg *msg) __attribute_warn_unused_result__;
     bool finish_get_native_env(Client *client, string env_key);
     void handle_old_request();
+    set<Client *> clients_waiting_for_env();
     bool handle_compile_file(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_activity(Client *client) __attribute_warn_unused_result__;
     bool handle_file_chunk_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
@@ -605,7 +678,10 @@ struct Daemon {
     bool handle_compile_done(Client *client) __attribute_warn_unused_result__;
     bool handle_verify_env(Client *client, VerifyEnvMsg *msg) __attribute_warn_unused_result__;
     bool handle_blacklist_host_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
+    void handle_compression_level(CompressionLevelMsg *msg);
     int handle_cs_conf(ConfCSMsg *msg);
+    int handle_compression_dict(CompressionDictMsg *msg);
+    bool send_compression_dicts(Client *client, const UseCSMsg &msg);
     string dump_internals() const;
     string determine_nodename();
     void determine_system();
@@ -680,6 +756,14 @@ bool Daemon::setup_listen_tcp_fd( int& fd, const string& interface )
         }
     }
 
+#ifdef TCP_FASTOPEN
+    // Let clients that connected before skip the handshake round trip.
+    optval = 64;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (const char *) &optval, sizeof(optval)) < 0) {
+        log_perror_trace("setsockopt(TCP_FASTOPEN)");
+    }
+#endif
+
     if (listen(fd, 1024) < 0) {
         log_perror("Failed to set TCP socket for listening to incoming connections");
         return false;
@@ -973,14 +1057,19 @@ bool Daemon::maybe_stats(bool force_check)
 
 #endif
 
+        free_mem = msg.freeMem;
         mem_limit = std::max(int(msg.freeMem / std::min(std::max(max_kids, 1U), 4U)), min_mem_limit);
 
+        // The scheduler places jobs that need much memory by the free memory.
         if (abs(int(msg.load) - current_load) >= 100
             || (msg.load == 1000 && current_load != 1000)
-            || (msg.load != 1000 && current_load == 1000)) {
+            || (msg.load != 1000 && current_load == 1000)
+            || abs(int(msg.freeMem) - current_free_mem) >= mem_limit) {
             if (!send_scheduler(msg)) {
                 return false;
             }
+
+            current_free_mem = msg.freeMem;
         }
 
         icecream_load = 0;
@@ -1062,7 +1151,13 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
     trace() << "scheduler_use_cs " << msg->job_id << " " << msg->client_id
             << " " << c << " " << msg->hostname << " " << remote_name <<  endl;
 
-    if (!c) {
+    /* A speculative duplicate of a job is only of use while the client
+       waits for the compile server, not when it compiles locally by now.  */
+    bool duplicate = c && c->accepts_duplicates && c->status == Client::WAITCOMPILE;
+    bool local = msg->hostname == remote_name && int(msg->port) == daemon_port;
+
+    if (!c || (c->accepts_duplicates && c->status != Client::WAITFORCS && !duplicate)
+            || (duplicate && (c->duplicate_job_id || local))) {
         if (send_scheduler(JobDoneMsg(msg->job_id, 107, JobDoneMsg::FROM_SUBMITTER, clients.size()))) {
             return 0;
         }
@@ -1070,15 +1165,37 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
         return 1;
     }
 
-    if (msg->hostname == remote_name && int(msg->port) == daemon_port) {
+    /* The client keeps waiting for its first compile server, the duplicate
+       is reported to the scheduler on its own.  */
+    if (duplicate) {
+        c->duplicate_usecsmsg = new UseCSMsg(msg->host_platform, msg->hostname, msg->port,
+                                             msg->job_id, true, 1, msg->matched_job_id);
+        c->duplicate_job_id = msg->job_id;
+
+        map<string, int>::const_iterator level = compression_levels.find(msg->hostname);
+        msg->compression_level = level != compression_levels.end() ? level->second : 0;
+
+        if (!send_compression_dicts(c, *msg) || !c->channel->send_msg(*msg)) {
+            handle_end(c, 143);
+        }
+
+        return 0;
+    }
+
+    if (local) {
         c->usecsmsg = new UseCSMsg(msg->host_platform, "127.0.0.1", daemon_port, msg->job_id, true, 1,
                                    msg->matched_job_id);
+        c->usecsmsg->source_dict_id = msg->source_dict_id;
+        c->usecsmsg->object_dict_id = msg->object_dict_id;
         c->status = Client::PENDING_USE_CS;
     } else {
         c->usecsmsg = new UseCSMsg(msg->host_platform, msg->hostname, msg->port,
                                    msg->job_id, true, 1, msg->matched_job_id);
 
-        if (!c->channel->send_msg(*msg)) {
+        map<string, int>::const_iterator level = compression_levels.find(msg->hostname);
+        msg->compression_level = level != compression_levels.end() ? level->second : 0;
+
+        if (!send_compression_dicts(c, *msg) || !c->channel->send_msg(*msg)) {
             handle_end(c, 143);
             return 0;
         }
@@ -1597,8 +1714,59 @@ bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
     return send_scheduler(*msg);
 }
 
+/* The scheduler hands out jobs for an environment that is still being
+   installed here, their clients don't send it again. Their compiles wait
+   until the install is done, and for a while if it hasn't even started, the
+   transfer may come in just after the job. The job says so, other jobs
+   without their environment fail right away as always.  */
+static const time_t ENV_INSTALL_WAIT = 10;
+
+set<Client *> Daemon::clients_waiting_for_env()
+{
+    set<Client *> held;
+    set<string> installing;
+    time_t now = time(0);
+    jobs_held = false;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (it->second->status == Client::TOINSTALL || it->second->status == Client::WAITINSTALL) {
+            installing.insert(it->second->outfile);
+        }
+    }
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        Client *client = it->second;
+
+        if (client->status != Client::TOCOMPILE || !client->job) {
+            continue;
+        }
+
+        CompileJob *job = client->job;
+
+        if (installing.count(job->targetPlatform() + "/" + job->environmentVersion())) {
+            held.insert(client);
+            continue;
+        }
+
+        if (!job->envInstalling() || now - client->compile_requested >= ENV_INSTALL_WAIT) {
+            continue;
+        }
+
+        string dirname = envbasedir + "/target=" + job->targetPlatform() + "/" + job->environmentVersion();
+
+        if (::access(string(dirname + "/usr/bin/as").c_str(), X_OK) < 0) {
+            held.insert(client);
+            jobs_held = true;
+        }
+    }
+
+    return held;
+}
+
 void Daemon::handle_old_request()
 {
+    jobs_held = false;
+
     while ((current_kids + clients.active_processes) < std::max((unsigned int)1, max_kids)) {
 
         Client *client = clients.get_earliest_client(Client::LINKJOB);
@@ -1627,7 +1795,8 @@ void Daemon::handle_old_request()
         if (client) {
             trace() << "pending " << client->dump() << endl;
 
-            if (client->channel->send_msg(*client->usecsmsg)) {
+            if (send_compression_dicts(client, *client->usecsmsg)
+                    && client->channel->send_msg(*client->usecsmsg)) {
                 client->status = Client::CLIENTWORK;
                 /* we make sure we reserve a spot and the rest is done if the
                  * client contacts as back with a Compile request */
@@ -1645,7 +1814,8 @@ void Daemon::handle_old_request()
             break;
         }
 
-        client = clients.get_earliest_client(Client::TOCOMPILE);
+        set<Client *> held = clients_waiting_for_env();
+        client = clients.get_most_urgent_client(Client::TOCOMPILE, held);
 
         if (client) {
             CompileJob *job = client->job;
@@ -1657,7 +1827,7 @@ void Daemon::handle_old_request()
 
             string envforjob = job->targetPlatform() + "/" + job->environmentVersion();
             envs_last_use[envforjob] = time(NULL);
-            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid);
+            pid = handle_connection(envbasedir, job, client->channel, sock, job_mem_limit(job), user_uid, user_gid);
             trace() << "handle connection returned " << pid << endl;
 
             if (pid > 0) {
@@ -1691,7 +1861,7 @@ bool Daemon::handle_compile_done(Client *client)
     assert(current_kids > 0);
     current_kids--;
 
-    unsigned int job_stat[8];
+    unsigned int job_stat[JobStatistics::job_stat_count];
     int end_status = 151;
 
     if (read(client->pipe_from_child, job_stat, sizeof(job_stat)) == sizeof(job_stat)) {
@@ -1703,6 +1873,7 @@ bool Daemon::handle_compile_done(Client *client)
         msg->user_msec = job_stat[JobStatistics::user_msec];
         msg->sys_msec = job_stat[JobStatistics::sys_msec];
         msg->pfaults = job_stat[JobStatistics::sys_pfaults];
+        msg->peak_rss = job_stat[JobStatistics::peak_rss];
     }
 
 #ifdef _WIN32
@@ -1723,11 +1894,17 @@ bool Daemon::handle_compile_done(Client *client)
 
 bool Daemon::handle_compile_file(Client *client, Msg *msg)
 {
-    CompileJob *job = dynamic_cast<CompileFileMsg *>(msg)->takeJob();
+    CompileFileMsg *cmsg = dynamic_cast<CompileFileMsg *>(msg);
+    CompileJob *job = cmsg->takeJob();
     assert(client);
     assert(job);
     client->job = job;
 
+    // compress the object file sent back using the dictionary the client has
+    if (CompressionDicts::has(cmsg->output_dict_id)) {
+        client->channel->set_compression_dict(cmsg->output_dict_id);
+    }
+
     if (client->status == Client::CLIENTWORK) {
         assert(job->environmentVersion() == "__client");
 
@@ -1740,6 +1917,7 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
         // no scheduler is not an error case!
     } else {
         client->status = Client::TOCOMPILE;
+        client->compile_requested = time(0);
     }
 
     return true;
@@ -1795,6 +1973,7 @@ void Daemon::handle_end(Client *client, int exitcode)
     if (client->status == Client::WAITCOMPILE && exitcode == 119) {
         /* the client sent us a real good bye, so forget about the scheduler */
         client->job_id = 0;
+        client->duplicate_job_id = 0;
     }
 
     /* Delete from the clients map before send_scheduler, which causes a
@@ -1857,6 +2036,11 @@ void Daemon::handle_end(Client *client, int exitcode)
             if (!send_scheduler(msg)) {
                 trace() << "failed to reach scheduler for remote job done msg!" << endl;
             }
+
+            if (client->duplicate_job_id
+                    && !send_scheduler(JobDoneMsg(client->duplicate_job_id, exitcode, flag, clients.size()))) {
+                trace() << "failed to reach scheduler for duplicate job done msg!" << endl;
+            }
         } else if (client->status == Client::CLIENTWORK) {
             // Clientwork && !job_id == LINK
             trace() << "scheduler->send_msg( JobLocalDoneMsg( " << client->client_id << ") );\n";
@@ -1907,7 +2091,10 @@ bool Daemon::handle_get_cs(Client *client, Msg *msg)
     GetCSMsg *umsg = dynamic_cast<GetCSMsg *>(msg);
     assert(client);
     client->status = Client::WAITFORCS;
+    client->accepts_duplicates = umsg->count == 1 && (umsg->flags & GetCSMsg::AcceptsDuplicates);
     umsg->client_id = client->client_id;
+    // of no interest to the scheduler
+    client->dict_ids.swap(umsg->dict_ids);
     trace() << "handle_get_cs " << umsg->client_id << endl;
 
     if (!scheduler) {
@@ -1933,6 +2120,51 @@ int Daemon::handle_cs_conf(ConfCSMsg *msg)
     return 0;
 }
 
+/* Clients exit after one job, so they pass on the compression level they
+   reached sending to the compile server for the next client.  */
+void Daemon::handle_compression_level(CompressionLevelMsg *msg)
+{
+    if (msg && !msg->host.empty() && msg->level) {
+        compression_levels[msg->host] = msg->level;
+    }
+}
+
+int Daemon::handle_compression_dict(CompressionDictMsg *msg)
+{
+    // not fatal, we just won't use it
+    CompressionDicts::add(msg->data);
+    return 0;
+}
+
+static bool client_has_dict(const Client *client, uint32_t dict_id)
+{
+    return find(client->dict_ids.begin(), client->dict_ids.end(), dict_id) != client->dict_ids.end();
+}
+
+/* Clients are short-lived, they cache the dictionaries on disk and say which
+   ones they have. Pass them those of the compile server they don't have.  */
+bool Daemon::send_compression_dicts(Client *client, const UseCSMsg &msg)
+{
+    MsgChannel *c = client->channel;
+
+    if (!IS_PROTOCOL_44(c)) {
+        return true;
+    }
+
+    if (CompressionDicts::has(msg.source_dict_id) && !client_has_dict(client, msg.source_dict_id)
+            && !c->send_msg(CompressionDictMsg(CompressionDicts::data(msg.source_dict_id)))) {
+        return false;
+    }
+
+    if (msg.object_dict_id != msg.source_dict_id && CompressionDicts::has(msg.object_dict_id)
+            && !client_has_dict(client, msg.object_dict_id)
+            && !c->send_msg(CompressionDictMsg(CompressionDicts::data(msg.object_dict_id)))) {
+        return false;
+    }
+
+    return true;
+}
+
 bool Daemon::handle_local_job(Client *client, Msg *msg)
 {
     client->status = Client::LINKJOB;
@@ -1988,6 +2220,10 @@ bool Daemon::handle_activity(Client *client)
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(client, msg);
         break;
+    case M_COMPRESSION_LEVEL:
+        handle_compression_level(dynamic_cast<CompressionLevelMsg *>(msg));
+        ret = true;
+        break;
     default:
         log_error() << "protocol error " << msg->type << " on client "
                     << client->dump() << endl;
@@ -2099,7 +2335,8 @@ void Daemon::answer_client_requests()
         }
     }
 
-    int ret = poll(pollfds.data(), pollfds.size(), max_scheduler_pong * 1000);
+    // Look at jobs waiting for a transfer again when it may have started or timed out.
+    int ret = poll(pollfds.data(), pollfds.size(), jobs_held ? 1000 : max_scheduler_pong * 1000);
 
     if (ret < 0 && errno != EINTR) {
         log_perror("poll");
@@ -2149,6 +2386,9 @@ void Daemon::answer_client_requests()
                 case M_CS_CONF:
                     ret = handle_cs_conf(static_cast<ConfCSMsg *>(msg));
                     break;
+                case M_COMPRESSION_DICT:
+                    ret = handle_compression_dict(static_cast<CompressionDictMsg *>(msg));
+                    break;
                 default:
                     log_error() << "unknown scheduler type " << (char)msg->type << endl;
                     ret = 1;
@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <cassert>
+#include <vector>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -208,10 +209,21 @@ static void write_output_file( const string& file, MsgChannel* client )
             throw myexception(EXIT_DISTCC_FAILED);
         }
 
-        unsigned char buffer[100000];
+        // objects are mostly much smaller than a chunk
+        static vector<unsigned char> buffer;
+        struct stat st;
+        size_t wanted = client->max_chunk_size();
+
+        if (fstat(obj_fd, &st) == 0) {
+            wanted = min(wanted, max(size_t(st.st_size), size_t(1)));
+        }
+
+        if (buffer.size() < wanted) {
+            buffer.resize(wanted);
+        }
 
         do {
-            ssize_t bytes = read(obj_fd, buffer, sizeof(buffer));
+            ssize_t bytes = read(obj_fd, &buffer[0], wanted);
 
             if (bytes < 0) {
                 if (errno == EINTR) {
@@ -229,7 +241,7 @@ static void write_output_file( const string& file, MsgChannel* client )
                 break;
             }
 
-            FileChunkMsg fcmsg(buffer, bytes);
+            FileChunkMsg fcmsg(&buffer[0], bytes);
 
             if (!client->send_msg(fcmsg)) {
                 log_info() << "write of obj chunk failed " << bytes << endl;
@@ -305,7 +317,8 @@ pid_t handle_connection(const string &basedir, CompileJob *job,
     /* internal communication channel, don't inherit to gcc */
     fcntl(out_fd, F_SETFD, FD_CLOEXEC);
 
-    int niceval = nice(nice_level);
+    // Background jobs make way for everything else on this host.
+    int niceval = nice(job->priority() == CompileJob::Priority_Background ? 19 : nice_level);
     if (niceval == -1) {
         log_warning() << "failed to set nice value: " << strerror(errno)
                       << endl;
@@ -342,7 +355,7 @@ pid_t handle_connection(const string &basedir, CompileJob *job,
         }
 
         int ret;
-        unsigned int job_stat[8];
+        unsigned int job_stat[JobStatistics::job_stat_count];
         CompileResultMsg rmsg;
         unsigned int job_id = job->jobID();
 
@@ -695,6 +695,13 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     return EXIT_DISTCC_FAILED;
                 }
 
+                // in kB, also for jobs that ran out of memory
+#ifdef __APPLE__
+                job_stat[JobStatistics::peak_rss] = ru.ru_maxrss / 1024;
+#else
+                job_stat[JobStatistics::peak_rss] = ru.ru_maxrss;
+#endif
+
                 if (shell_exit_status(status) != 0) {
                     if( !rmsg.out.empty())
                         trace() << "compiler produced stdout output:\n" << rmsg.out;
@@ -47,7 +47,8 @@ public:
 namespace JobStatistics
 {
 enum job_stat_fields { in_compressed, in_uncompressed, out_uncompressed, exit_code,
-                       real_msec, user_msec, sys_msec, sys_pfaults
+                       real_msec, user_msec, sys_msec, sys_pfaults, peak_rss,
+                       job_stat_count
                      };
 }
 
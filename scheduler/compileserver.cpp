@@ -25,6 +25,7 @@
 
 #include <algorithm>
 #include <fcntl.h>
+#include <math.h>
 #include <netdb.h>
 #include <time.h>
 #include <unistd.h>
@@ -34,6 +35,7 @@
 
 #include "job.h"
 #include "scheduler.h"
+#include "serverindex.h"
 
 
 unsigned int CompileServer::s_hostIdCounter = 0;
@@ -44,9 +46,19 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_hostId(0)
     , m_nodeName()
     , m_busyInstalling(0)
+    , m_installBytes(0)
+    , m_installRate()
+    , m_seeding(false)
+    , m_installingEnv(0, 0)
     , m_hostPlatform()
+    , m_hostPlatformId(0)
     , m_load(1000)
     , m_maxJobs(0)
+    , m_preloadCount(-1)
+    , m_jobDuration()
+    , m_dispatchTime()
+    , m_freeMem(0)
+    , m_freeMemTime(0)
     , m_noRemote(false)
     , m_jobList()
     , m_state(CONNECTED)
@@ -57,10 +69,15 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_submittedJobsCount(0)
     , m_lastPickId(0)
     , m_compilerVersions()
+    , m_compilerVersionIds()
     , m_lastCompiledJobs()
     , m_lastRequestedJobs()
     , m_cumCompiled()
     , m_cumRequested()
+    , m_speedModel()
+    , m_shareUsage(0)
+    , m_shareUpdated(0)
+    , m_shareWeight(1)
     , m_clientMap()
     , m_blacklist()
     , m_inFd(-1)
@@ -68,6 +85,7 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_nextConnTime(0)
     , m_lastConnStartTime(0)
     , m_acceptingInConnection(true)
+    , m_index(0)
 {
 }
 
@@ -85,40 +103,45 @@ bool CompileServer::check_remote(const Job *job) const
 
 bool CompileServer::platforms_compatible(const string &target) const
 {
-    if (target == hostPlatform()) {
+    return platforms_compatible(intern_name(target));
+}
+
+bool CompileServer::platforms_compatible(NameId target) const
+{
+    if (target == m_hostPlatformId) {
         return true;
     }
 
     // the below doesn't work as the unmapped platform is transferred back to the
     // client and that asks the daemon for a platform he can't install (see TODO)
 
-    static multimap<string, string> platform_map;
+    static multimap<NameId, NameId> platform_map;
 
     if (platform_map.empty()) {
-        platform_map.insert(make_pair(string("i386"), string("i486")));
-        platform_map.insert(make_pair(string("i386"), string("i586")));
-        platform_map.insert(make_pair(string("i386"), string("i686")));
-        platform_map.insert(make_pair(string("i386"), string("x86_64")));
+        platform_map.insert(make_pair(intern_name("i386"), intern_name("i486")));
+        platform_map.insert(make_pair(intern_name("i386"), intern_name("i586")));
+        platform_map.insert(make_pair(intern_name("i386"), intern_name("i686")));
+        platform_map.insert(make_pair(intern_name("i386"), intern_name("x86_64")));
 
-        platform_map.insert(make_pair(string("i486"), string("i586")));
-        platform_map.insert(make_pair(string("i486"), string("i686")));
-        platform_map.insert(make_pair(string("i486"), string("x86_64")));
+        platform_map.insert(make_pair(intern_name("i486"), intern_name("i586")));
+        platform_map.insert(make_pair(intern_name("i486"), intern_name("i686")));
+        platform_map.insert(make_pair(intern_name("i486"), intern_name("x86_64")));
 
-        platform_map.insert(make_pair(string("i586"), string("i686")));
-        platform_map.insert(make_pair(string("i586"), string("x86_64")));
+        platform_map.insert(make_pair(intern_name("i586"), intern_name("i686")));
+        platform_map.insert(make_pair(intern_name("i586"), intern_name("x86_64")));
 
-        platform_map.insert(make_pair(string("i686"), string("x86_64")));
+        platform_map.insert(make_pair(intern_name("i686"), intern_name("x86_64")));
 
-        platform_map.insert(make_pair(string("ppc"), string("ppc64")));
-        platform_map.insert(make_pair(string("s390"), string("s390x")));
+        platform_map.insert(make_pair(intern_name("ppc"), intern_name("ppc64")));
+        platform_map.insert(make_pair(intern_name("s390"), intern_name("s390x")));
     }
 
-    multimap<string, string>::const_iterator end = platform_map.upper_bound(target);
+    multimap<NameId, NameId>::const_iterator end = platform_map.upper_bound(target);
 
-    for (multimap<string, string>::const_iterator it = platform_map.lower_bound(target);
+    for (multimap<NameId, NameId>::const_iterator it = platform_map.lower_bound(target);
             it != end;
             ++it) {
-        if (it->second == hostPlatform()) {
+        if (it->second == m_hostPlatformId) {
             return true;
         }
     }
@@ -144,10 +167,11 @@ string CompileServer::can_install(const Job *job, bool ignore_installing) const
         return string();
     }
 
-    Environments environments = job->environments();
-    for (Environments::const_iterator it = environments.begin();
-            it != environments.end(); ++it) {
-        if (platforms_compatible(it->first) && !blacklisted(job, *it)) {
+    const Environments &environments = job->environments();
+    const EnvironmentIds &ids = job->environmentIds();
+    Environments::const_iterator it = environments.begin();
+    for (EnvironmentIds::const_iterator id = ids.begin(); id != ids.end(); ++id, ++it) {
+        if (platforms_compatible(id->first) && !blacklisted(job, *it)) {
             return it->first;
         }
     }
@@ -155,16 +179,129 @@ string CompileServer::can_install(const Job *job, bool ignore_installing) const
     return string();
 }
 
+/* Given a candidate CS and a JOB, check all installed environments
+   on the CS for a match.  Return an empty string if none of the required
+   environments for this job is installed.  Otherwise return the
+   host platform of the first found installed environment which is among
+   the requested.  That can be send to the client, which then completely
+   specifies which environment to use (name, host platform and target
+   platform).
+   The environment the CS is busy installing counts as installed if the
+   daemon holds back the jobs for it until the install is done.  */
+string CompileServer::envs_match(const Job *job) const
+{
+    if (job->submitter() == this) {
+        return hostPlatform();    // it will compile itself
+    }
+
+    /* Check all installed envs on the candidate CS ...  */
+    for (EnvironmentIds::const_iterator it = m_compilerVersionIds.begin();
+            it != m_compilerVersionIds.end(); ++it) {
+        string platform = env_match(*it, job);
+
+        if (!platform.empty()) {
+            return platform;
+        }
+    }
+
+    if (installs_env(job)) {
+        return env_match(m_installingEnv, job);
+    }
+
+    return string();
+}
+
+/* Whether the environment of JOB is the one the CS is busy installing, and
+   the daemon holds back the jobs for it until the install is done.  */
+bool CompileServer::installs_env(const Job *job) const
+{
+    return busyInstalling() && m_installingEnv.second && IS_PROTOCOL_51(this)
+           && !env_match(m_installingEnv, job).empty();
+}
+
+string CompileServer::env_match(const EnvironmentId &env, const Job *job) const
+{
+    if (env.first == job->targetPlatformId()) {
+        /* ... ENV now is an installed environment which produces code for
+           the requested target platform.  Now look at each env which
+           could be installed from the client (i.e. those coming with the
+           job) if it matches in name and additionally could be run
+           by the candidate CS.  */
+        const EnvironmentIds &environments = job->environmentIds();
+        for (EnvironmentIds::const_iterator it = environments.begin();
+                it != environments.end(); ++it) {
+            if (env.second == it->second && platforms_compatible(it->first)) {
+                return interned_name(it->first);
+            }
+        }
+    }
+
+    return string();
+}
+
 int CompileServer::maxPreloadCount() const
 {
-    // Always allow one job to be preloaded (sent to the compile server
-    // even though there is no compile slot free for it). Since servers
-    // with multiple cores are capable of handling many jobs at once,
-    // allow one extra preload job for each 4 cores, to minimize stalls
-    // when the compile server is waiting for more jobs to be received.
+    if (m_preloadCount >= 0) {
+        return m_preloadCount;
+    }
+
+    // Until it's known how long jobs take there, always allow one job to
+    // be preloaded (sent to the compile server even though there is no
+    // compile slot free for it). Since servers with multiple cores are
+    // capable of handling many jobs at once, allow one extra preload job
+    // for each 4 cores, to minimize stalls when the compile server is
+    // waiting for more jobs to be received.
     return 1 + (m_maxJobs / 4);
 }
 
+const DecayingAverage &CompileServer::jobDuration() const
+{
+    return m_jobDuration;
+}
+
+void CompileServer::addJobDuration(float msec, time_t now)
+{
+    m_jobDuration.add(msec, now);
+    updatePreloadCount(now);
+}
+
+const DecayingAverage &CompileServer::dispatchTime() const
+{
+    return m_dispatchTime;
+}
+
+void CompileServer::addDispatchTime(float msec, time_t now)
+{
+    m_dispatchTime.add(msec, now);
+    updatePreloadCount(now);
+}
+
+// samples of both job duration and dispatch time needed to size the preload
+static const float MIN_PRELOAD_WEIGHT = 3;
+// jobs preloaded per job expected to finish while the next one is dispatched
+static const float PRELOAD_FACTOR = 2;
+
+/* While a job is dispatched, maxJobs * dispatch time / job duration jobs
+   finish on average. With that many preloaded, plus some for the jobs
+   that take less than average, slots don't stay empty waiting for the
+   next job. Nodes with long jobs get none, a preloaded job would only
+   wait there while other nodes might be free. At most maxJobs.  */
+void CompileServer::updatePreloadCount(time_t now)
+{
+    int count = -1;
+
+    if (m_jobDuration.weight(now) >= MIN_PRELOAD_WEIGHT && m_dispatchTime.weight(now) >= MIN_PRELOAD_WEIGHT
+            && m_jobDuration.value() > 0) {
+        float finishing = m_maxJobs * m_dispatchTime.value() / m_jobDuration.value();
+        count = min(int(ceilf(PRELOAD_FACTOR * finishing)), max(m_maxJobs, 1));
+    }
+
+    if (count != m_preloadCount) {
+        m_preloadCount = count;
+        changed();
+    }
+}
+
 bool CompileServer::is_eligible_ever(const Job *job) const
 {
     bool jobs_okay = m_maxJobs > 0;
@@ -195,19 +332,56 @@ bool CompileServer::is_eligible_now(const Job *job) const
     if(!is_eligible_ever(job))
         return false;
     bool jobs_okay = int(m_jobList.size()) < m_maxJobs;
-    if( m_maxJobs > 0 && int(m_jobList.size()) < m_maxJobs + maxPreloadCount())
+    if( m_maxJobs > 0 && int(m_jobList.size()) < m_maxJobs + maxPreloadCount()
+            && !busyInstalling())
         jobs_okay = true; // allow a job for preloading
     bool load_okay = m_load < 1000;
+    bool mem_okay = can_hold(job);
+    // While installing, it only takes jobs whose environment is or will be there.
+    bool env_okay = busyInstalling() && IS_PROTOCOL_51(this) ? !envs_match(job).empty()
+                    : !can_install(job, false).empty();
     bool eligible = jobs_okay
                     && load_okay
-                    && can_install(job, false).size();
+                    && mem_okay
+                    && env_okay;
 #if DEBUG_SCHEDULER > 2
     trace() << nodeName() << " is_eligible_now: " << eligible << " (jobs_okay " << jobs_okay
-        << ", load_okay " << load_okay << ")" << endl;
+        << ", load_okay " << load_okay << ", mem_okay " << mem_okay << ")" << endl;
 #endif
     return eligible;
 }
 
+unsigned int CompileServer::freeMem() const
+{
+    return m_freeMem;
+}
+
+void CompileServer::setFreeMem(unsigned int mb)
+{
+    m_freeMem = mb;
+    m_freeMemTime = time(0);
+}
+
+bool CompileServer::can_hold(const Job *job) const
+{
+    if (!job->expectedMemory() || !m_freeMem || m_jobList.empty()
+            || time(0) - job->queuedOnScheduler() > MAX_MEMORY_WAIT) {
+        return true;
+    }
+
+    /* Jobs compiling since before the stats use memory that isn't free
+       anymore, the others will still take theirs.  */
+    uint64_t reserved = job->expectedMemory();
+
+    for (vector<Job *>::const_iterator it = m_jobList.begin(); it != m_jobList.end(); ++it) {
+        if ((*it)->state() != Job::COMPILING || (*it)->startOnScheduler() >= m_freeMemTime) {
+            reserved += (*it)->expectedMemory();
+        }
+    }
+
+    return reserved <= uint64_t(m_freeMem) * 1024;
+}
+
 unsigned int CompileServer::remotePort() const
 {
     return m_remotePort;
@@ -228,7 +402,7 @@ void CompileServer::setHostId(unsigned int id)
     m_hostId = id;
 }
 
-string CompileServer::nodeName() const
+const string &CompileServer::nodeName() const
 {
     return m_nodeName;
 }
@@ -251,16 +425,70 @@ time_t CompileServer::busyInstalling() const
 void CompileServer::setBusyInstalling(time_t time)
 {
     m_busyInstalling = time;
+
+    if (!time) {
+        m_installingEnv = EnvironmentId(0, 0);
+    }
+
+    changed();
 }
 
-string CompileServer::hostPlatform() const
+const EnvironmentId &CompileServer::installingEnv() const
+{
+    return m_installingEnv;
+}
+
+void CompileServer::setInstallingEnv(const EnvironmentId &env)
+{
+    m_installingEnv = env;
+    changed();
+}
+
+unsigned int CompileServer::installBytes() const
+{
+    return m_installBytes;
+}
+
+void CompileServer::setInstallBytes(unsigned int bytes)
+{
+    m_installBytes = bytes;
+}
+
+const DecayingAverage &CompileServer::installRate() const
+{
+    return m_installRate;
+}
+
+void CompileServer::addInstallRate(float rate, time_t now)
+{
+    m_installRate.add(rate, now);
+}
+
+bool CompileServer::seeding() const
+{
+    return m_seeding;
+}
+
+void CompileServer::setSeeding(bool seeding)
+{
+    m_seeding = seeding;
+}
+
+const string &CompileServer::hostPlatform() const
 {
     return m_hostPlatform;
 }
 
+NameId CompileServer::hostPlatformId() const
+{
+    return m_hostPlatformId;
+}
+
 void CompileServer::setHostPlatform(const string &platform)
 {
     m_hostPlatform = platform;
+    m_hostPlatformId = intern_name(platform);
+    changed();
 }
 
 unsigned int CompileServer::load() const
@@ -271,6 +499,7 @@ unsigned int CompileServer::load() const
 void CompileServer::setLoad(unsigned int load)
 {
     m_load = load;
+    changed();
 }
 
 int CompileServer::maxJobs() const
@@ -281,6 +510,8 @@ int CompileServer::maxJobs() const
 void CompileServer::setMaxJobs(int jobs)
 {
     m_maxJobs = jobs;
+    updatePreloadCount(time(0));
+    changed();
 }
 
 bool CompileServer::noRemote() const
@@ -291,9 +522,10 @@ bool CompileServer::noRemote() const
 void CompileServer::setNoRemote(bool value)
 {
     m_noRemote = value;
+    changed();
 }
 
-list<Job *> CompileServer::jobList() const
+const vector<Job *> &CompileServer::jobList() const
 {
     return m_jobList;
 }
@@ -302,11 +534,13 @@ void CompileServer::appendJob(Job *job)
 {
     m_lastPickId = job->id();
     m_jobList.push_back(job);
+    changed();
 }
 
 void CompileServer::removeJob(Job *job)
 {
-    m_jobList.remove(job);
+    m_jobList.erase(remove(m_jobList.begin(), m_jobList.end(), job), m_jobList.end());
+    changed();
 }
 
 unsigned int CompileServer::lastPickedId()
@@ -342,6 +576,7 @@ bool CompileServer::chrootPossible() const
 void CompileServer::setChrootPossible(const bool possible)
 {
     m_chrootPossible = possible;
+    changed();
 }
 
 bool CompileServer::featuresSupported(unsigned int features) const
@@ -384,17 +619,24 @@ void CompileServer::submittedJobsDecrement()
     m_submittedJobsCount--;
 }
 
-Environments CompileServer::compilerVersions() const
+const Environments &CompileServer::compilerVersions() const
 {
     return m_compilerVersions;
 }
 
+const EnvironmentIds &CompileServer::compilerVersionIds() const
+{
+    return m_compilerVersionIds;
+}
+
 void CompileServer::setCompilerVersions(const Environments &environments)
 {
     m_compilerVersions = environments;
+    m_compilerVersionIds = intern_environments(environments);
+    changed();
 }
 
-list<JobStat> CompileServer::lastCompiledJobs() const
+const RingBuffer<JobStat> &CompileServer::lastCompiledJobs() const
 {
     return m_lastCompiledJobs;
 }
@@ -402,14 +644,16 @@ list<JobStat> CompileServer::lastCompiledJobs() const
 void CompileServer::appendCompiledJob(const JobStat &stats)
 {
     m_lastCompiledJobs.push_back(stats);
+    changed();
 }
 
 void CompileServer::popCompiledJob()
 {
     m_lastCompiledJobs.pop_front();
+    changed();
 }
 
-list<JobStat> CompileServer::lastRequestedJobs() const
+const RingBuffer<JobStat> &CompileServer::lastRequestedJobs() const
 {
     return m_lastRequestedJobs;
 }
@@ -432,6 +676,7 @@ JobStat CompileServer::cumCompiled() const
 void CompileServer::setCumCompiled(const JobStat &stats)
 {
     m_cumCompiled = stats;
+    changed();
 }
 
 JobStat CompileServer::cumRequested() const
@@ -444,6 +689,45 @@ void CompileServer::setCumRequested(const JobStat &stats)
     m_cumRequested = stats;
 }
 
+const SpeedModel &CompileServer::speedModel() const
+{
+    return m_speedModel;
+}
+
+bool CompileServer::addSpeedSample(SpeedClass cls, float speed, time_t now)
+{
+    if (!m_speedModel.add(cls, speed, now)) {
+        return false;
+    }
+
+    changed();
+    return true;
+}
+
+// Usage halves every 10 minutes.
+static const float SHARE_HALF_LIFE = 600;
+
+float CompileServer::shareUsage(time_t now) const
+{
+    return m_shareUsage * powf(0.5, (now - m_shareUpdated) / SHARE_HALF_LIFE);
+}
+
+void CompileServer::addShareUsage(float msec, time_t now)
+{
+    m_shareUsage = max(shareUsage(now) + msec, 0.0f);
+    m_shareUpdated = now;
+}
+
+float CompileServer::shareWeight() const
+{
+    return m_shareWeight;
+}
+
+void CompileServer::setShareWeight(float weight)
+{
+    m_shareWeight = weight;
+}
+
 int CompileServer::getClientJobId(const int localJobId)
 {
     return m_clientMap[localJobId];
@@ -459,16 +743,11 @@ void CompileServer::eraseClientJobId(const int localJobId)
     m_clientMap.erase(localJobId);
 }
 
-map<const CompileServer *, Environments> CompileServer::blacklist() const
+const map<const CompileServer *, Environments> &CompileServer::blacklist() const
 {
     return m_blacklist;
 }
 
-Environments CompileServer::getEnvsForBlacklistedCS(const CompileServer *cs)
-{
-    return m_blacklist[cs];
-}
-
 void CompileServer::blacklistCompileServer(CompileServer *cs, const std::pair<std::string, std::string> &env)
 {
     m_blacklist[cs].push_back(env);
@@ -481,8 +760,14 @@ void CompileServer::eraseCSFromBlacklist(CompileServer *cs)
 
 bool CompileServer::blacklisted(const Job *job, const pair<string, string> &environment) const
 {
-    Environments blacklist = job->submitter()->getEnvsForBlacklistedCS(this);
-    return find(blacklist.begin(), blacklist.end(), environment) != blacklist.end();
+    const map<const CompileServer *, Environments> &blacklist = job->submitter()->blacklist();
+    map<const CompileServer *, Environments>::const_iterator it = blacklist.find(this);
+
+    if (it == blacklist.end()) {
+        return false;
+    }
+
+    return find(it->second.begin(), it->second.end(), environment) != it->second.end();
 }
 
 int CompileServer::getInFd() const
@@ -537,6 +822,7 @@ void CompileServer::updateInConnectivity(bool acceptingIn)
         if(!m_acceptingInConnection)
         {
             m_acceptingInConnection = true;
+            changed();
             m_inConnAttempt = 0;
             trace() << "Client (" << m_nodeName <<
                 " " << name <<
@@ -552,6 +838,7 @@ void CompileServer::updateInConnectivity(bool acceptingIn)
         if(m_acceptingInConnection)
         {
             m_acceptingInConnection = false;
+            changed();
             trace() << "Client (" << m_nodeName <<
                 " " << name <<
                 ":" << m_remotePort <<
@@ -569,6 +856,23 @@ void CompileServer::updateInConnectivity(bool acceptingIn)
 
 }
 
+bool CompileServer::acceptingInConnection() const
+{
+    return m_acceptingInConnection;
+}
+
+void CompileServer::setIndex(ServerIndex *index)
+{
+    m_index = index;
+}
+
+void CompileServer::changed()
+{
+    if (m_index) {
+        m_index->markDirty(this);
+    }
+}
+
 bool CompileServer::isConnected()
 {
     if (getConnectionTimeout() == 0)
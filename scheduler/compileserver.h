@@ -27,11 +27,16 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
 
 #include "../services/comm.h"
 #include "jobstat.h"
+#include "names.h"
+#include "ringbuffer.h"
+#include "speedmodel.h"
 
 class Job;
+class ServerIndex;
 
 using namespace std;
 
@@ -57,7 +62,10 @@ public:
 
     bool check_remote(const Job *job) const;
     bool platforms_compatible(const string &target) const;
+    bool platforms_compatible(NameId target) const;
     string can_install(const Job *job, bool ignore_installing = false) const;
+    string envs_match(const Job *job) const;
+    bool installs_env(const Job *job) const;
     bool is_eligible_ever(const Job *job) const;
     bool is_eligible_now(const Job *job) const;
 
@@ -67,7 +75,7 @@ public:
     unsigned int hostId() const;
     void setHostId(const unsigned int id);
 
-    string nodeName() const;
+    const string &nodeName() const;
     void setNodeName(const string &name);
 
     bool matches(const string& nm) const;
@@ -75,7 +83,25 @@ public:
     time_t busyInstalling() const;
     void setBusyInstalling(const time_t time);
 
-    string hostPlatform() const;
+    /* Bytes of the environment being installed, and how many bytes per
+       msec the installs on this server took, from assigning the job that
+       needed it until the daemon logged in again with it.  */
+    unsigned int installBytes() const;
+    void setInstallBytes(unsigned int bytes);
+    const DecayingAverage &installRate() const;
+    void addInstallRate(float rate, time_t now);
+
+    // busy installing an environment a client seeds it with, not for a job
+    bool seeding() const;
+    void setSeeding(bool seeding);
+
+    /* The environment being installed while busyInstalling(), as target
+       platform and version, jobs for it are queued behind the install.  */
+    const EnvironmentId &installingEnv() const;
+    void setInstallingEnv(const EnvironmentId &env);
+
+    const string &hostPlatform() const;
+    NameId hostPlatformId() const;
     void setHostPlatform(const string &platform);
 
     unsigned int load() const;
@@ -83,12 +109,30 @@ public:
 
     int maxJobs() const;
     void setMaxJobs(const int jobs);
+
+    /* How many jobs it gets beyond its slots, so that the next job is
+       there when a slot frees up. Sized from how long its jobs take and
+       how long it takes from assigning a job until the daemon starts it.  */
     int maxPreloadCount() const;
+    const DecayingAverage &jobDuration() const;
+    void addJobDuration(float msec, time_t now);
+    const DecayingAverage &dispatchTime() const;
+    void addDispatchTime(float msec, time_t now);
+
+    // free memory in MB at the daemon's last stats, 0 if unknown
+    unsigned int freeMem() const;
+    void setFreeMem(unsigned int mb);
+
+    /* There is memory for JOB next to the jobs that weren't running yet at
+       the last stats, or it's unknown how much it needs.  */
+    bool can_hold(const Job *job) const;
+    // After this long in the queue a job goes anywhere, so it doesn't wait forever.
+    static const time_t MAX_MEMORY_WAIT = 60;
 
     bool noRemote() const;
     void setNoRemote(const bool value);
 
-    list<Job *> jobList() const;
+    const vector<Job *> &jobList() const;
     void appendJob(Job *job);
     void removeJob(Job *job);
     unsigned int lastPickedId();
@@ -112,14 +156,15 @@ public:
     void submittedJobsIncrement();
     void submittedJobsDecrement();
 
-    Environments compilerVersions() const;
+    const Environments &compilerVersions() const;
+    const EnvironmentIds &compilerVersionIds() const;
     void setCompilerVersions(const Environments &environments);
 
-    list<JobStat> lastCompiledJobs() const;
+    const RingBuffer<JobStat> &lastCompiledJobs() const;
     void appendCompiledJob(const JobStat &stats);
     void popCompiledJob();
 
-    list<JobStat> lastRequestedJobs() const;
+    const RingBuffer<JobStat> &lastRequestedJobs() const;
     void appendRequestedJobs(const JobStat &stats);
     void popRequestedJobs();
 
@@ -129,6 +174,18 @@ public:
     JobStat cumRequested() const;
     void setCumRequested(const JobStat &stats);
 
+    const SpeedModel &speedModel() const;
+    // Returns false if the sample was rejected as an outlier.
+    bool addSpeedSample(SpeedClass cls, float speed, time_t now);
+
+    /* Compile time (user msec) the jobs submitted by this daemon took,
+       decaying over time, for the fair share of the farm it gets. The
+       weight scales its share.  */
+    float shareUsage(time_t now) const;
+    void addShareUsage(float msec, time_t now);
+    float shareWeight() const;
+    void setShareWeight(float weight);
+
 
     unsigned int hostidCounter() const;
 
@@ -136,8 +193,7 @@ public:
     void insertClientJobId(const int localJobId, const int newJobId);
     void eraseClientJobId(const int localJobId);
 
-    map<const CompileServer *, Environments> blacklist() const;
-    Environments getEnvsForBlacklistedCS(const CompileServer *cs);
+    const map<const CompileServer *, Environments> &blacklist() const;
     void blacklistCompileServer(CompileServer *cs, const std::pair<std::string, std::string> &env);
     void eraseCSFromBlacklist(CompileServer *cs);
 
@@ -148,22 +204,39 @@ public:
     bool getConnectionInProgress();
     bool isConnected();
     void updateInConnectivity(bool acceptingIn);
+    bool acceptingInConnection() const;
+
+    // The scheduler's index of servers this one is in, it's told about changes.
+    void setIndex(ServerIndex *index);
 
 private:
     bool blacklisted(const Job *job, const pair<string, string> &environment) const;
+    string env_match(const EnvironmentId &env, const Job *job) const;
+    void updatePreloadCount(time_t now);
+    void changed();
 
     /* The listener port, on which it takes compile requests.  */
     unsigned int m_remotePort;
     unsigned int m_hostId;
     string m_nodeName;
     time_t m_busyInstalling;
+    unsigned int m_installBytes;
+    DecayingAverage m_installRate;
+    bool m_seeding;
+    EnvironmentId m_installingEnv;
     string m_hostPlatform;
+    NameId m_hostPlatformId;
 
     // LOAD is load * 1000
     unsigned int m_load;
     int m_maxJobs;
+    int m_preloadCount; // -1 until there is enough data
+    DecayingAverage m_jobDuration; // msec
+    DecayingAverage m_dispatchTime; // msec
+    unsigned int m_freeMem;
+    time_t m_freeMemTime; // when m_freeMem was reported
     bool m_noRemote;
-    list<Job *> m_jobList;
+    vector<Job *> m_jobList;
     State m_state;
     Type m_type;
     bool m_chrootPossible;
@@ -173,11 +246,16 @@ private:
     unsigned int m_lastPickId;
 
     Environments m_compilerVersions;  // Available compilers
+    EnvironmentIds m_compilerVersionIds;  // interned m_compilerVersions
 
-    list<JobStat> m_lastCompiledJobs;
-    list<JobStat> m_lastRequestedJobs;
+    RingBuffer<JobStat> m_lastCompiledJobs;
+    RingBuffer<JobStat> m_lastRequestedJobs;
     JobStat m_cumCompiled;  // cumulated
     JobStat m_cumRequested;
+    SpeedModel m_speedModel;
+    float m_shareUsage;
+    time_t m_shareUpdated;
+    float m_shareWeight;
 
     static unsigned int s_hostIdCounter;
     map<int, int> m_clientMap; // map client ID for daemon to our IDs
@@ -188,6 +266,8 @@ private:
     time_t m_nextConnTime;
     time_t m_lastConnStartTime;
     bool m_acceptingInConnection;
+
+    ServerIndex *m_index;
 };
 
 #endif
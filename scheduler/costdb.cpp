@@ -0,0 +1,218 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "costdb.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../services/logging.h"
+
+using namespace std;
+
+static const uint32_t COSTDB_MAGIC = 0x49434344; // "ICCD"
+static const uint32_t COSTDB_VERSION = 2;
+// 14 MiB, a slot for every file of a few large projects
+static const uint32_t COSTDB_SLOTS = 1 << 18;
+static const uint32_t COSTDB_PROBES = 8;
+// the table starts at a cache line
+static const size_t COSTDB_TABLE_OFFSET = 64;
+
+struct CostDB::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint64_t used;
+};
+
+CostDB::CostDB()
+    : m_header(0)
+    , m_table(0)
+    , m_mapped(0)
+{
+}
+
+CostDB::~CostDB()
+{
+    close();
+}
+
+bool CostDB::open(const string &path)
+{
+    close();
+
+    if (!path.empty()) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd < 0) {
+            log_perror("open() of compile cost database failed") << "\t" << path << endl;
+        } else {
+            bool ok = map_table(fd);
+            ::close(fd);
+
+            if (ok) {
+                log_info() << "compile cost database " << path << " has " << size()
+                           << " entries" << endl;
+                return true;
+            }
+        }
+    }
+
+    map_table(-1);
+    return path.empty();
+}
+
+void CostDB::close()
+{
+    if (m_header) {
+        munmap(m_header, m_mapped);
+    }
+
+    m_header = 0;
+    m_table = 0;
+    m_mapped = 0;
+}
+
+bool CostDB::map_table(int fd)
+{
+    size_t size = COSTDB_TABLE_OFFSET + size_t(COSTDB_SLOTS) * sizeof(CompileCost);
+    void *p;
+
+    if (fd >= 0) {
+        struct stat st;
+
+        if (fstat(fd, &st) != 0) {
+            log_perror("fstat() of compile cost database failed");
+            return false;
+        }
+
+        // another size is from another version, start over
+        if (st.st_size != off_t(size) && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+            log_perror("ftruncate() of compile cost database failed");
+            return false;
+        }
+
+        p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (p == MAP_FAILED) {
+        log_perror("mmap() of compile cost database failed");
+        return false;
+    }
+
+    m_header = static_cast<Header *>(p);
+    m_table = reinterpret_cast<CompileCost *>(static_cast<char *>(p) + COSTDB_TABLE_OFFSET);
+    m_mapped = size;
+
+    if (m_header->magic != COSTDB_MAGIC || m_header->version != COSTDB_VERSION
+            || m_header->slots != COSTDB_SLOTS || m_header->slot_size != sizeof(CompileCost)) {
+        // a new file is all zeros already
+        if (m_header->magic != 0) {
+            memset(p, 0, size);
+        }
+
+        m_header->magic = COSTDB_MAGIC;
+        m_header->version = COSTDB_VERSION;
+        m_header->slots = COSTDB_SLOTS;
+        m_header->slot_size = sizeof(CompileCost);
+        m_header->used = 0;
+    }
+
+    return true;
+}
+
+// FNV-1a, 0 marks free slots
+uint64_t CostDB::make_key(const string &data)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (string::const_iterator it = data.begin(); it != data.end(); ++it) {
+        hash ^= (unsigned char)*it;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash ? hash : 1;
+}
+
+const CompileCost *CostDB::find(uint64_t key) const
+{
+    if (!m_table) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < COSTDB_PROBES; ++i) {
+        const CompileCost *cost = &m_table[(key + i) & (COSTDB_SLOTS - 1)];
+
+        if (cost->key == key) {
+            return cost;
+        }
+
+        if (cost->key == 0) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+CompileCost *CostDB::insert(uint64_t key, uint32_t now)
+{
+    if (!m_table) {
+        return 0;
+    }
+
+    CompileCost *victim = 0;
+
+    for (uint32_t i = 0; i < COSTDB_PROBES; ++i) {
+        CompileCost *cost = &m_table[(key + i) & (COSTDB_SLOTS - 1)];
+
+        if (cost->key == key) {
+            cost->last_used = now;
+            return cost;
+        }
+
+        if (cost->key == 0) {
+            victim = cost;
+            ++m_header->used;
+            break;
+        }
+
+        if (!victim || cost->last_used < victim->last_used) {
+            victim = cost;
+        }
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    victim->key = key;
+    victim->last_used = now;
+    return victim;
+}
+
+size_t CostDB::size() const
+{
+    return m_header ? m_header->used : 0;
+}
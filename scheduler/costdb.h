@@ -0,0 +1,79 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef COSTDB_H
+#define COSTDB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/* What compiling one file with the same flags and environment cost the last
+   times. All values are averages over the recent jobs.  */
+struct CompileCost {
+    uint64_t key;
+    uint32_t last_used; // time() of the last update, for eviction
+    uint32_t count; // jobs seen, the average is over at most the last 8
+    uint32_t work; // flag-normalized output size, like JobStat::outputSize()
+    uint32_t real_msec;
+    uint32_t user_msec;
+    uint32_t sys_msec;
+    uint32_t in_size; // uncompressed preprocessed source
+    uint32_t out_size; // uncompressed object file
+    uint32_t transfer; // compressed bytes sent to and back from the compile server
+    uint32_t pfaults;
+    uint32_t peak_rss; // kB, goes up at once and down slowly
+};
+
+/* Compile costs by file, in a fixed-size hash table in a memory mapped file,
+   so that they survive restarts of the scheduler. Without a file the table
+   lives in anonymous memory. Lookups and updates only probe a few slots,
+   when they are all taken the least recently updated one is replaced.  */
+class CostDB
+{
+public:
+    CostDB();
+    ~CostDB();
+
+    /* Maps PATH, or anonymous memory if PATH is empty. A file from another
+       version or with another size is started over. Returns false if the
+       file can't be used, the table is in memory then.  */
+    bool open(const std::string &path);
+    void close();
+
+    static uint64_t make_key(const std::string &data);
+
+    const CompileCost *find(uint64_t key) const;
+    // Returns the entry for KEY, a new zeroed one if it doesn't exist yet.
+    CompileCost *insert(uint64_t key, uint32_t now);
+
+    size_t size() const;
+
+private:
+    struct Header;
+
+    bool map_table(int fd);
+
+    Header *m_header;
+    CompileCost *m_table;
+    size_t m_mapped;
+};
+
+#endif
@@ -23,8 +23,21 @@
 
 #include "job.h"
 
+#include "config.h"
+
 #include "compileserver.h"
 
+/* Jobs are carved out of slabs of JOBS_PER_SLAB and deleted ones are kept
+   in a free list for the next ones, instead of going through malloc for
+   each of them. Slabs are never given back.  */
+static const size_t JOBS_PER_SLAB = 256;
+
+struct FreeJob {
+    FreeJob *next;
+};
+
+static FreeJob *free_jobs = 0;
+
 Job::Job(const unsigned int _id, CompileServer *subm)
     : m_id(_id)
     , m_localClientId(0)
@@ -33,8 +46,10 @@ Job::Job(const unsigned int _id, CompileServer *subm)
     , m_submitter(subm)
     , m_startTime(0)
     , m_startOnScheduler(0)
+    , m_queuedOnScheduler(0)
     , m_doneTime(0)
     , m_targetPlatform()
+    , m_targetPlatformId(0)
     , m_fileName()
     , m_masterJobFor()
     , m_argFlags(0)
@@ -42,6 +57,15 @@ Job::Job(const unsigned int _id, CompileServer *subm)
     , m_preferredHost()
     , m_minimalHostVersion(0)
     , m_requiredFeatures(0)
+    , m_priority(CompileJob::Priority_Normal)
+    , m_expectedWork(0)
+    , m_expectedTransfer(0)
+    , m_acceptsDuplicate(false)
+    , m_duplicateId(0)
+    , m_chargedMsec(0)
+    , m_envSize(0)
+    , m_expectedMemory(0)
+    , m_assignedMsec(0)
 {
     m_submitter->submittedJobsIncrement();
 }
@@ -54,6 +78,45 @@ Job::~Job()
     m_submitter->submittedJobsDecrement();
 }
 
+void *Job::operator new(size_t size)
+{
+#ifndef SANITIZER_USED
+    if (size == sizeof(Job)) {
+        if (!free_jobs) {
+            char *slab = static_cast<char *>(::operator new(JOBS_PER_SLAB * sizeof(Job)));
+
+            for (size_t i = 0; i < JOBS_PER_SLAB; ++i) {
+                FreeJob *job = reinterpret_cast<FreeJob *>(slab + i * sizeof(Job));
+                job->next = free_jobs;
+                free_jobs = job;
+            }
+        }
+
+        FreeJob *job = free_jobs;
+        free_jobs = job->next;
+        return job;
+    }
+#endif
+
+    return ::operator new(size);
+}
+
+void Job::operator delete(void *p, size_t size)
+{
+#ifndef SANITIZER_USED
+    if (p && size == sizeof(Job)) {
+        FreeJob *job = static_cast<FreeJob *>(p);
+        job->next = free_jobs;
+        free_jobs = job;
+        return;
+    }
+#else
+    (void)size;
+#endif
+
+    ::operator delete(p);
+}
+
 unsigned int Job::id() const
 {
     return m_id;
@@ -99,24 +162,32 @@ void Job::setSubmitter(CompileServer *submitter)
     m_submitter = submitter;
 }
 
-Environments Job::environments() const
+const Environments &Job::environments() const
 {
     return m_environments;
 }
 
+const EnvironmentIds &Job::environmentIds() const
+{
+    return m_environmentIds;
+}
+
 void Job::setEnvironments(const Environments &environments)
 {
     m_environments = environments;
+    m_environmentIds = intern_environments(environments);
 }
 
 void Job::appendEnvironment(const std::pair<std::string, std::string> &env)
 {
     m_environments.push_back(env);
+    m_environmentIds.push_back(EnvironmentId(intern_name(env.first), intern_name(env.second)));
 }
 
 void Job::clearEnvironments()
 {
     m_environments.clear();
+    m_environmentIds.clear();
 }
 
 time_t Job::startTime() const
@@ -139,6 +210,16 @@ void Job::setStartOnScheduler(const time_t time)
     m_startOnScheduler = time;
 }
 
+time_t Job::queuedOnScheduler() const
+{
+    return m_queuedOnScheduler;
+}
+
+void Job::setQueuedOnScheduler(const time_t time)
+{
+    m_queuedOnScheduler = time;
+}
+
 time_t Job::doneTime() const
 {
     return m_doneTime;
@@ -149,17 +230,23 @@ void Job::setDoneTime(const time_t time)
     m_doneTime = time;
 }
 
-std::string Job::targetPlatform() const
+const std::string &Job::targetPlatform() const
 {
     return m_targetPlatform;
 }
 
+NameId Job::targetPlatformId() const
+{
+    return m_targetPlatformId;
+}
+
 void Job::setTargetPlatform(const std::string &platform)
 {
     m_targetPlatform = platform;
+    m_targetPlatformId = intern_name(platform);
 }
 
-std::string Job::fileName() const
+const std::string &Job::fileName() const
 {
     return m_fileName;
 }
@@ -169,7 +256,7 @@ void Job::setFileName(const std::string &fileName)
     m_fileName = fileName;
 }
 
-std::list<Job *> Job::masterJobFor() const
+const std::list<Job *> &Job::masterJobFor() const
 {
     return m_masterJobFor;
 }
@@ -189,7 +276,7 @@ void Job::setArgFlags(const unsigned int argFlags)
     m_argFlags = argFlags;
 }
 
-std::string Job::language() const
+const std::string &Job::language() const
 {
     return m_language;
 }
@@ -199,7 +286,7 @@ void Job::setLanguage(const std::string &language)
     m_language = language;
 }
 
-std::string Job::preferredHost() const
+const std::string &Job::preferredHost() const
 {
     return m_preferredHost;
 }
@@ -228,3 +315,89 @@ void Job::setRequiredFeatures(unsigned int features)
 {
     m_requiredFeatures = features;
 }
+
+CompileJob::Priority Job::priority() const
+{
+    return m_priority;
+}
+
+void Job::setPriority(CompileJob::Priority priority)
+{
+    m_priority = priority;
+}
+
+bool Job::acceptsDuplicate() const
+{
+    return m_acceptsDuplicate;
+}
+
+void Job::setAcceptsDuplicate(bool accepts)
+{
+    m_acceptsDuplicate = accepts;
+}
+
+unsigned int Job::duplicateId() const
+{
+    return m_duplicateId;
+}
+
+void Job::setDuplicateId(unsigned int id)
+{
+    m_duplicateId = id;
+}
+
+float Job::chargedMsec() const
+{
+    return m_chargedMsec;
+}
+
+void Job::setChargedMsec(float msec)
+{
+    m_chargedMsec = msec;
+}
+
+unsigned int Job::envSize() const
+{
+    return m_envSize;
+}
+
+void Job::setEnvSize(unsigned int size)
+{
+    m_envSize = size;
+}
+
+unsigned int Job::expectedMemory() const
+{
+    return m_expectedMemory;
+}
+
+void Job::setExpectedMemory(unsigned int kb)
+{
+    m_expectedMemory = kb;
+}
+
+uint64_t Job::assignedMsec() const
+{
+    return m_assignedMsec;
+}
+
+void Job::setAssignedMsec(uint64_t msec)
+{
+    m_assignedMsec = msec;
+}
+
+float Job::expectedWork() const
+{
+    return m_expectedWork;
+}
+
+float Job::expectedTransfer() const
+{
+    return m_expectedTransfer;
+}
+
+void Job::setExpectedCost(float work, float transfer)
+{
+    m_expectedWork = work;
+    m_expectedTransfer = transfer;
+}
@@ -25,10 +25,12 @@
 #define JOB_H
 
 #include <list>
+#include <stddef.h>
 #include <string>
 #include <time.h>
 
 #include "../services/comm.h"
+#include "names.h"
 
 class CompileServer;
 
@@ -44,6 +46,10 @@ public:
     Job(const unsigned int _id, CompileServer *subm);
     ~Job();
 
+    // Jobs come and go all the time, they are allocated from slabs.
+    static void *operator new(size_t size);
+    static void operator delete(void *p, size_t size);
+
     unsigned int id() const;
 
     unsigned int localClientId() const;
@@ -58,7 +64,8 @@ public:
     CompileServer *submitter() const;
     void setSubmitter(CompileServer *submitter);
 
-    Environments environments() const;
+    const Environments &environments() const;
+    const EnvironmentIds &environmentIds() const;
     void setEnvironments(const Environments &environments);
     void appendEnvironment(const std::pair<std::string, std::string> &env);
     void clearEnvironments();
@@ -69,25 +76,29 @@ public:
     time_t startOnScheduler() const;
     void setStartOnScheduler(const time_t time);
 
+    time_t queuedOnScheduler() const;
+    void setQueuedOnScheduler(const time_t time);
+
     time_t doneTime() const;
     void setDoneTime(const time_t time);
 
-    std::string targetPlatform() const;
+    const std::string &targetPlatform() const;
+    NameId targetPlatformId() const;
     void setTargetPlatform(const std::string &platform);
 
-    std::string fileName() const;
+    const std::string &fileName() const;
     void setFileName(const std::string &fileName);
 
-    std::list<Job *> masterJobFor() const;
+    const std::list<Job *> &masterJobFor() const;
     void appendJob(Job *job);
 
     unsigned int argFlags() const;
     void setArgFlags(const unsigned int argFlags);
 
-    std::string language() const;
+    const std::string &language() const;
     void setLanguage(const std::string &language);
 
-    std::string preferredHost() const;
+    const std::string &preferredHost() const;
     void setPreferredHost(const std::string &host);
 
     int minimalHostVersion() const;
@@ -96,6 +107,41 @@ public:
     unsigned int requiredFeatures() const;
     void setRequiredFeatures(unsigned int features);
 
+    // how soon the client wants the job compiled, from ICECC_PRIORITY
+    CompileJob::Priority priority() const;
+    void setPriority(CompileJob::Priority priority);
+
+    // the client can take a speculative duplicate of the job
+    bool acceptsDuplicate() const;
+    void setAcceptsDuplicate(bool accepts);
+
+    /* The other job for the same compile, the speculative duplicate or
+       the job it duplicates, 0 if there is none.  */
+    unsigned int duplicateId() const;
+    void setDuplicateId(unsigned int id);
+
+    // compile time charged to the submitter's share when the job was assigned
+    float chargedMsec() const;
+    void setChargedMsec(float msec);
+
+    // bytes of the environment to install where it's missing, 0 if unknown
+    unsigned int envSize() const;
+    void setEnvSize(unsigned int size);
+
+    // peak memory in kB the compiler needed for the file, 0 if unknown
+    unsigned int expectedMemory() const;
+    void setExpectedMemory(unsigned int kb);
+
+    /* When the job was handed to a server with a free slot, in msec, 0 if
+       it was preloaded or has to wait for an install there.  */
+    uint64_t assignedMsec() const;
+    void setAssignedMsec(uint64_t msec);
+
+    // expected size of the job, see JobCost in scheduler.cpp
+    float expectedWork() const;
+    float expectedTransfer() const;
+    void setExpectedCost(float work, float transfer);
+
 private:
     const unsigned int m_id;
     unsigned int m_localClientId;
@@ -103,8 +149,10 @@ private:
     CompileServer *m_server;  // on which server we build
     CompileServer *m_submitter;  // who submitted us
     Environments m_environments;
+    EnvironmentIds m_environmentIds; // interned m_environments
     time_t m_startTime;  // _local_ to the compiler server
     time_t m_startOnScheduler;  // starttime local to scheduler
+    time_t m_queuedOnScheduler;  // when the job request came in
     /**
      * the end signal from client and daemon is a bit of a race and
      * in 99.9% of all cases it's catched correctly. But for the remaining
@@ -114,6 +162,7 @@ private:
     time_t m_doneTime;
 
     std::string m_targetPlatform;
+    NameId m_targetPlatformId;
     std::string m_fileName;
     std::list<Job *> m_masterJobFor;
     unsigned int m_argFlags;
@@ -121,6 +170,15 @@ private:
     std::string m_preferredHost; // for debugging daemons
     int m_minimalHostVersion; // minimal version required for the the remote server
     unsigned int m_requiredFeatures; // flags the job requires on the remote server
+    CompileJob::Priority m_priority;
+    float m_expectedWork;
+    float m_expectedTransfer;
+    bool m_acceptsDuplicate;
+    unsigned int m_duplicateId;
+    float m_chargedMsec;
+    unsigned int m_envSize;
+    unsigned int m_expectedMemory;
+    uint64_t m_assignedMsec;
 };
 
 #endif
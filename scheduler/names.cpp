@@ -0,0 +1,65 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "names.h"
+
+#include <cassert>
+#include <map>
+
+using namespace std;
+
+static map<string, NameId> name_ids;
+static vector<string> names(1);
+
+NameId intern_name(const string &name)
+{
+    if (name.empty()) {
+        return 0;
+    }
+
+    map<string, NameId>::const_iterator it = name_ids.find(name);
+
+    if (it != name_ids.end()) {
+        return it->second;
+    }
+
+    NameId id = names.size();
+    names.push_back(name);
+    name_ids[name] = id;
+    return id;
+}
+
+const string &interned_name(NameId id)
+{
+    assert(id < names.size());
+    return names[id];
+}
+
+EnvironmentIds intern_environments(const Environments &environments)
+{
+    EnvironmentIds ids;
+    ids.reserve(environments.size());
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        ids.push_back(EnvironmentId(intern_name(it->first), intern_name(it->second)));
+    }
+
+    return ids;
+}
@@ -0,0 +1,42 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../services/comm.h"
+
+/* Platform and environment names are compared over and over when picking
+   servers, so they are interned and compared as small integers instead.
+   Equal names get equal ids, the empty name is always 0. Names are never
+   forgotten, there are only as many as different ones were ever seen.  */
+typedef unsigned int NameId;
+typedef std::pair<NameId, NameId> EnvironmentId; // host platform, version
+typedef std::vector<EnvironmentId> EnvironmentIds;
+
+NameId intern_name(const std::string &name);
+const std::string &interned_name(NameId id);
+EnvironmentIds intern_environments(const Environments &environments);
+
+#endif
@@ -0,0 +1,152 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+/* A FIFO in one contiguous array, for the sliding windows of job stats.
+   Unlike std::list it doesn't allocate for every element, the array
+   only grows until it can hold the largest size of the window.  */
+template<typename T>
+class RingBuffer
+{
+public:
+    class const_iterator
+    {
+    public:
+        const_iterator(const RingBuffer *ring, size_t pos)
+            : m_ring(ring)
+            , m_pos(pos) {}
+
+        const T &operator*() const
+        {
+            return m_ring->at(m_pos);
+        }
+
+        const T *operator->() const
+        {
+            return &m_ring->at(m_pos);
+        }
+
+        const_iterator &operator++()
+        {
+            ++m_pos;
+            return *this;
+        }
+
+        bool operator==(const const_iterator &other) const
+        {
+            return m_pos == other.m_pos;
+        }
+
+        bool operator!=(const const_iterator &other) const
+        {
+            return m_pos != other.m_pos;
+        }
+
+    private:
+        const RingBuffer *m_ring;
+        size_t m_pos;
+    };
+
+    RingBuffer()
+        : m_data()
+        , m_head(0)
+        , m_size(0) {}
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    const T &front() const
+    {
+        assert(m_size);
+        return at(0);
+    }
+
+    const T &back() const
+    {
+        assert(m_size);
+        return at(m_size - 1);
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, m_size);
+    }
+
+    void push_back(const T &value)
+    {
+        if (m_size == m_data.size()) {
+            grow();
+        }
+
+        m_data[(m_head + m_size) % m_data.size()] = value;
+        ++m_size;
+    }
+
+    void pop_front()
+    {
+        assert(m_size);
+        m_head = (m_head + 1) % m_data.size();
+        --m_size;
+    }
+
+private:
+    const T &at(size_t pos) const
+    {
+        return m_data[(m_head + pos) % m_data.size()];
+    }
+
+    void grow()
+    {
+        std::vector<T> data;
+        data.reserve(m_data.empty() ? 8 : 2 * m_data.size());
+
+        for (size_t i = 0; i < m_size; ++i) {
+            data.push_back(at(i));
+        }
+
+        data.resize(data.capacity());
+        m_data.swap(data);
+        m_head = 0;
+    }
+
+    std::vector<T> m_data;
+    size_t m_head;
+    size_t m_size;
+};
+
+#endif
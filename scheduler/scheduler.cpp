@@ -28,6 +28,8 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <dirent.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -45,10 +47,13 @@
 #include <queue>
 #include <algorithm>
 #include <cassert>
+#include <cfloat>
 #include <fstream>
+#include <math.h>
 #include <string>
 #include <stdio.h>
 #include <pwd.h>
+#include <zdict.h>
 #include "../services/comm.h"
 #include "../services/getifaddrs.h"
 #include "../services/logging.h"
@@ -57,8 +62,12 @@
 #include "config.h"
 
 #include "compileserver.h"
+#include "costdb.h"
 #include "job.h"
+#include "ringbuffer.h"
 #include "scheduler.h"
+#include "serverindex.h"
+#include "speedmodel.h"
 
 /* TODO:
    * leak check
@@ -119,10 +128,88 @@ struct UnansweredList {
 };
 static list<UnansweredList *> toanswer;
 
-static list<JobStat> all_job_stats;
+/* Set when assigning the queued jobs could have a different outcome than
+   the last time empty_queue() gave up: a job was queued, or a server that
+   can run one of the waiting jobs may have room for it now.  */
+static bool queue_changed = false;
+
+static RingBuffer<JobStat> all_job_stats;
 static JobStat cum_job_stats;
 
-static float server_speed(CompileServer *cs, Job *job = 0, bool blockDebug = false);
+/* What compiling a file cost the last times, to predict the next job for
+   the same file. The work in it is in the units of JobStat::outputSize(),
+   so work divided by server_speed() is the expected compile time in
+   milliseconds.  */
+static CostDB cost_db;
+static string cost_db_path;
+static float avg_job_transfer = 0;
+
+// Speeds of the kinds of jobs, as output bytes per user msec.
+static SpeedModel class_speeds;
+// Speeds of all nodes together, in the units of server_speed().
+static DecayingAverage farm_speed;
+// How many jobs the farm average counts in a node's speed.
+static const float SPEED_PRIOR_JOBS = 3;
+
+// Bandwidth assumed when projecting transfer times, 100 Mbit/s in bytes per ms.
+static const float TRANSFER_BYTES_PER_MSEC = 12500;
+
+/* How fast environments get installed, in bytes per msec, over all nodes.
+   Used for the nodes that haven't installed anything yet.  */
+static DecayingAverage farm_install_rate;
+// Environment size the clients reported, for the jobs of older clients.
+static float avg_env_size = 0;
+// Environment size assumed if no client reported one yet.
+static const float DEFAULT_ENV_SIZE = 50 * 1024 * 1024;
+
+/* How many jobs asked for an environment lately, by target platform and
+   version. Environments many jobs ask for are seeded to idle servers: the
+   client of a job is told to send its environment to one as well, see
+   UseCSMsg::seed_host.  */
+struct EnvDemand {
+    EnvDemand()
+        : jobs(0)
+        , updated(0) {}
+
+    float jobs;
+    time_t updated;
+};
+static map<EnvironmentId, EnvDemand> env_demand;
+// Demand halves every 5 minutes.
+static const float ENV_DEMAND_HALF_LIFE = 300;
+// Seed environments that at least this many recent jobs asked for.
+static const float HOT_ENV_JOBS = 20;
+/* Limits on the transfers for seeding, so that they don't saturate the
+   network: as many servers installing a seeded environment at once, and
+   seconds between starting two of them.  */
+static const int MAX_SEEDS = 2;
+static const time_t SEED_INTERVAL = 2;
+/* Nobody tells when a client fails to seed, a seed that takes this many
+   times as long as the install should, and at least the minimum seconds,
+   is given up.  */
+static const float SEED_OVERDUE_FACTOR = 3;
+static const time_t MIN_SEED_WAIT = 15;
+static time_t last_seed = 0;
+
+// Compression dictionaries handed out to daemons, trained at startup.
+static string source_dict;
+static string object_dict;
+static uint32_t source_dict_id = 0;
+static uint32_t object_dict_id = 0;
+
+// wall clock in msec, for timing the dispatch of jobs
+static uint64_t now_msec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
+static float server_speed(CompileServer *cs, Job *job = 0, bool blockDebug = false,
+                          bool remote = false);
+static float index_score(CompileServer *cs, Job *job);
+static float projected_finish(CompileServer *cs, Job *job, float *delay);
+static ServerIndex server_index(index_score, projected_finish);
 
 /* Searches the queue for JOB and removes it.
    Returns true if something was deleted.  */
@@ -139,49 +226,136 @@ bool UnansweredList::remove_job(Job *job)
     return false;
 }
 
+// The same file with other flags or another compiler is a different job.
+static uint64_t job_cost_key(const Job *job)
+{
+    char flags[16];
+    sprintf(flags, "%u", job->argFlags());
+
+    string key = job->fileName();
+    key += '\0';
+    key += flags;
+    key += '\0';
+    key += job->targetPlatform();
+
+    const Environments &envs = job->environments();
+
+    for (Environments::const_iterator it = envs.begin(); it != envs.end(); ++it) {
+        key += '\0';
+        key += it->second;
+    }
+
+    return CostDB::make_key(key);
+}
+
+// Average of the last N values (at most 8) that ended in VALUE.
+static uint32_t cost_average(uint32_t average, uint64_t value, uint32_t n)
+{
+    return uint32_t(int64_t(average) + (int64_t(value) - int64_t(average)) / int64_t(min(n, 8u)));
+}
+
+static void update_job_cost(Job *job, const JobStat &st, JobDoneMsg *msg)
+{
+    uint64_t transfer = uint64_t(msg->in_compressed) + msg->out_compressed;
+    avg_job_transfer = avg_job_transfer ? 0.9 * avg_job_transfer + 0.1 * transfer : transfer;
+
+    if (job->fileName().empty()) {
+        return;
+    }
+
+    CompileCost *cost = cost_db.insert(job_cost_key(job), time(0));
+
+    if (!cost) {
+        return;
+    }
+
+    uint32_t n = ++cost->count;
+    cost->work = cost_average(cost->work, st.outputSize(), n);
+    cost->real_msec = cost_average(cost->real_msec, msg->real_msec, n);
+    cost->user_msec = cost_average(cost->user_msec, msg->user_msec, n);
+    cost->sys_msec = cost_average(cost->sys_msec, msg->sys_msec, n);
+    cost->in_size = cost_average(cost->in_size, msg->in_uncompressed, n);
+    cost->out_size = cost_average(cost->out_size, msg->out_uncompressed, n);
+    cost->transfer = cost_average(cost->transfer, transfer, n);
+    cost->pfaults = cost_average(cost->pfaults, msg->pfaults, n);
+}
+
+/* The expected cost of JOB, from earlier jobs for its file or else from
+   the average of all recent jobs. An entry may only know the memory, if
+   the jobs for the file failed so far.  */
+static void predict_job_cost(Job *job)
+{
+    const CompileCost *cost = job->fileName().empty() ? 0 : cost_db.find(job_cost_key(job));
+
+    if (cost) {
+        job->setExpectedMemory(cost->peak_rss);
+    }
+
+    if (cost && cost->count > 0) {
+        job->setExpectedCost(cost->work, cost->transfer);
+    } else if (!all_job_stats.empty()) {
+        job->setExpectedCost(float(cum_job_stats.outputSize()) / all_job_stats.size(),
+                             avg_job_transfer);
+    }
+}
+
+/* The peak memory of the compiler for the file, also from failed jobs, as
+   they may have run out of it. A job that needs more counts at once, less
+   only slowly, a node short of memory costs more than a wasted slot.  */
+static void update_job_memory(Job *job, JobDoneMsg *msg)
+{
+    if (!msg->peak_rss || job->fileName().empty()) {
+        return;
+    }
+
+    CompileCost *cost = cost_db.insert(job_cost_key(job), time(0));
+
+    if (cost) {
+        cost->peak_rss = max(msg->peak_rss, cost_average(cost->peak_rss, msg->peak_rss, 4));
+    }
+}
+
 static void add_job_stats(Job *job, JobDoneMsg *msg)
 {
     JobStat st;
 
     /* We don't want to base our timings on failed or too small jobs.  */
     if (msg->out_uncompressed < 4096
+            || msg->user_msec == 0
             || msg->exitcode != 0) {
         return;
     }
 
+    job->server()->addJobDuration(msg->real_msec, time(0));
+
     st.setOutputSize(msg->out_uncompressed);
     st.setCompileTimeReal(msg->real_msec);
     st.setCompileTimeUser(msg->user_msec);
     st.setCompileTimeSys(msg->sys_msec);
     st.setJobId(job->id());
 
-    if (job->argFlags() & CompileJob::Flag_g) {
-        st.setOutputSize(st.outputSize() * 10 / 36);    // average over 1900 jobs: faktor 3.6 in osize
-    } else if (job->argFlags() & CompileJob::Flag_g3) {
-        st.setOutputSize(st.outputSize() * 10 / 45);    // average over way less jobs: factor 1.25 over -g
-    }
+    /* How much output per time a job produces depends a lot on the
+       compiler, language and flags. Scale the output size by how fast
+       this class of jobs is compared to all jobs, so that the speeds of
+       nodes which got different kinds of jobs can be compared.  */
+    time_t now = time(0);
+    SpeedClass cls = speed_class(job);
+    class_speeds.add(cls, float(msg->out_uncompressed) / msg->user_msec, now);
+    float cls_speed = class_speeds.speed(cls, now);
 
-    // the difference between the -O flags isn't as big as the one between -O0 and -O>=1
-    // the numbers are actually for gcc 3.3 - but they are _very_ rough heurstics anyway)
-    if (job->argFlags() & CompileJob::Flag_O
-            || job->argFlags() & CompileJob::Flag_O2
-            || job->argFlags() & CompileJob::Flag_Ol2) {
-        st.setOutputSize(st.outputSize() * 58 / 35);
+    if (cls_speed > 0) {
+        st.setOutputSize((unsigned long)(st.outputSize() * class_speeds.overall() / cls_speed));
     }
 
-    if (job->server()->lastCompiledJobs().size() >= 7) {
-        /* Smooth out spikes by not allowing one job to add more than
-           20% of the current speed.  */
-        float this_speed = (float) st.outputSize() / (float) st.compileTimeUser();
-        /* The current speed of the server, but without adjusting to the current
-           job, hence no second argument.  */
-        float cur_speed = server_speed(job->server());
+    update_job_cost(job, st, msg);
 
-        if ((this_speed / 1.2) > cur_speed) {
-            st.setOutputSize((long unsigned) (cur_speed * 1.2 * st.compileTimeUser()));
-        } else if ((this_speed * 1.2) < cur_speed) {
-            st.setOutputSize((long unsigned)(cur_speed / 1.2 * st.compileTimeUser()));
-        }
+    float speed = float(st.outputSize()) / st.compileTimeUser();
+
+    if (job->server()->addSpeedSample(cls, speed, now)) {
+        farm_speed.add(speed, now);
+    } else {
+        trace() << "ignoring speed " << speed << " of job " << job->id() << " on "
+                << job->server()->nodeName() << " as an outlier" << endl;
     }
 
     job->server()->appendCompiledJob(st);
@@ -246,20 +420,42 @@ static void notify_monitors(Msg *m)
     delete m;
 }
 
-static float server_speed(CompileServer *cs, Job *job, bool blockDebug)
+/* The speed of CS for jobs like JOB without its current load, 0 if not
+   known yet.  */
+static float model_speed(CompileServer *cs, Job *job)
+{
+    const SpeedModel &model = cs->speedModel();
+
+    if (model.empty()) {
+        return 0;
+    }
+
+    float f = job ? model.speed(speed_class(job), time(0)) : model.overall();
+
+    /* Until a node has compiled a few jobs its speed is not known well,
+       pull it towards the average of all nodes.  */
+    if (farm_speed.value() > 0) {
+        f = (model.samples() * f + SPEED_PRIOR_JOBS * farm_speed.value())
+            / (model.samples() + SPEED_PRIOR_JOBS);
+    }
+
+    return f;
+}
+
+/* With REMOTE and no JOB, rate CS for a job submitted by some other host.  */
+static float server_speed(CompileServer *cs, Job *job, bool blockDebug, bool remote)
 {
 #if DEBUG_SCHEDULER <= 2
     (void)blockDebug;
 #endif
-    if (cs->lastCompiledJobs().size() == 0 || cs->cumCompiled().compileTimeUser() == 0) {
+    if (cs->speedModel().empty()) {
         return 0;
     } else {
-        float f = (float)cs->cumCompiled().outputSize()
-                  / (float) cs->cumCompiled().compileTimeUser();
+        float f = model_speed(cs, job);
 
         // we only care for the load if we're about to add a job to it
-        if (job) {
-            if (job->submitter() == cs) {
+        if (job || remote) {
+            if (job && job->submitter() == cs) {
                 int clientCount = cs->clientCount();
                 if( clientCount == 0 ) {
                     // Older client/daemon that doesn't send client count. Use the number of jobs
@@ -313,13 +509,189 @@ static float server_speed(CompileServer *cs, Job *job, bool blockDebug)
             f *= (1.0f - (0.5f * cs->jobList().size() / cs->maxJobs()));
         }
 
-        // below we add a pessimism factor - assuming the first job a computer got is not representative
-        if (cs->lastCompiledJobs().size() < 7) {
-            f *= (-0.5 * cs->lastCompiledJobs().size() + 4.5);
+        return f;
+    }
+}
+
+static float index_score(CompileServer *cs, Job *job)
+{
+    return server_speed(cs, job, false, job == 0);
+}
+
+/* Milliseconds it takes to get the environment of JOB onto CS, 0 if
+   it has it already.  */
+static float install_msec(CompileServer *cs, float size)
+{
+    if (!size) {
+        size = avg_env_size ? avg_env_size : DEFAULT_ENV_SIZE;
+    }
+
+    float rate = cs->installRate().value();
+
+    if (rate <= 0) {
+        rate = farm_install_rate.value() > 0 ? farm_install_rate.value() : TRANSFER_BYTES_PER_MSEC;
+    }
+
+    return size / rate;
+}
+
+static float install_msec(CompileServer *cs, Job *job)
+{
+    if (cs == job->submitter() || !cs->envs_match(job).empty()) {
+        return 0;
+    }
+
+    return install_msec(cs, job->envSize());
+}
+
+/* The environment of JOB that a server of HOST_PLATFORM would install,
+   as target platform and version.  */
+static EnvironmentId job_environment(Job *job, const string &host_platform)
+{
+    const Environments &environments = job->environments();
+    const EnvironmentIds &ids = job->environmentIds();
+    EnvironmentIds::const_iterator id = ids.begin();
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it, ++id) {
+        if (it->first == host_platform) {
+            return EnvironmentId(job->targetPlatformId(), id->second);
         }
+    }
 
-        return f;
+    return EnvironmentId(0, 0);
+}
+
+/* Milliseconds from now until CS would have JOB done: waiting for a free
+   slot behind the jobs it has already, installing the environment if CS
+   doesn't have it, sending the job over and compiling it. The jobs CS has
+   are assumed to take their slots in order. DELAY is set to the time of
+   the waiting and the install, faster servers don't save on that.  */
+static float projected_finish(CompileServer *cs, Job *job, float *delay)
+{
+    /* The wait behind the jobs of CS is projected below, its speed is only
+       reduced by the load, not by those jobs as well. The load of the
+       submitter is assumed to be its own.  */
+    float speed = model_speed(cs, job);
+
+    if (cs != job->submitter()) {
+        speed *= float(1000 - cs->load()) / 1000;
+    }
+
+    *delay = 0;
+
+    if (speed <= 0 || cs->maxJobs() <= 0) {
+        return FLT_MAX;
     }
+
+    float wait = 0;
+    const vector<Job *> &jobList = cs->jobList();
+
+    if (int(jobList.size()) >= cs->maxJobs()) {
+        time_t now = time(0);
+        priority_queue<float, vector<float>, greater<float> > slots;
+
+        for (vector<Job *>::const_iterator it = jobList.begin(); it != jobList.end(); ++it) {
+            float duration = (*it)->expectedWork() / speed;
+
+            if (int(slots.size()) < cs->maxJobs()) {
+                if ((*it)->state() == Job::COMPILING) {
+                    duration -= 1000.0 * (now - (*it)->startOnScheduler());
+                }
+
+                slots.push(max(duration, 0.0f));
+            } else {
+                float start = slots.top();
+                slots.pop();
+                slots.push(start + duration);
+            }
+        }
+
+        wait = slots.top();
+    }
+
+    // Jobs queued behind an install can't start before it's done.
+    if (cs->busyInstalling() && cs != job->submitter()) {
+        float installed = install_msec(cs, float(cs->installBytes()))
+                          - 1000.0 * (time(0) - cs->busyInstalling());
+        wait = max(wait, installed);
+    }
+
+    float install = install_msec(cs, job);
+    *delay = wait + install;
+
+    float transfer = cs == job->submitter() ? 0 : job->expectedTransfer() / TRANSFER_BYTES_PER_MSEC;
+    return wait + install + transfer + job->expectedWork() / speed;
+}
+
+static float env_demand_jobs(const EnvDemand &demand, time_t now)
+{
+    return demand.jobs * powf(0.5, (now - demand.updated) / ENV_DEMAND_HALF_LIFE);
+}
+
+static void add_env_demand(Job *job, time_t now)
+{
+    const EnvironmentIds &environments = job->environmentIds();
+
+    for (EnvironmentIds::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        EnvDemand &demand = env_demand[EnvironmentId(job->targetPlatformId(), it->second)];
+        demand.jobs = env_demand_jobs(demand, now) + 1;
+        demand.updated = now;
+    }
+}
+
+static bool env_hot(Job *job, time_t now)
+{
+    const EnvironmentIds &environments = job->environmentIds();
+
+    for (EnvironmentIds::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        map<EnvironmentId, EnvDemand>::const_iterator demand
+            = env_demand.find(EnvironmentId(job->targetPlatformId(), it->second));
+
+        if (demand != env_demand.end() && env_demand_jobs(demand->second, now) >= HOT_ENV_JOBS) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* An idle server the client of JOB should seed its environment to while
+   SERVER compiles the job, the fastest one that could install it. 0 if
+   the environment isn't in demand or too many seeds are going on.  */
+static CompileServer *seed_target(Job *job, CompileServer *server)
+{
+    time_t now = time(0);
+
+    if (job->duplicateId() || !IS_PROTOCOL_50(job->submitter())
+            || now - last_seed < SEED_INTERVAL || !env_hot(job, now)) {
+        return 0;
+    }
+
+    CompileServer *best = 0;
+    int seeds = 0;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *cs = *it;
+
+        if (cs->seeding()) {
+            if (++seeds >= MAX_SEEDS) {
+                return 0;
+            }
+
+            continue;
+        }
+
+        if (cs == server || cs == job->submitter() || !cs->jobList().empty()
+                || !cs->envs_match(job).empty() || !cs->is_eligible_now(job)) {
+            continue;
+        }
+
+        if (!best || server_speed(cs) > server_speed(best)) {
+            best = cs;
+        }
+    }
+
+    return best;
 }
 
 static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = 0)
@@ -376,8 +748,107 @@ static Job *create_new_job(CompileServer *submitter)
     return job;
 }
 
+/* Weights of the fair share of the farm, by host name or address as given
+   with -w. Daemons not listed have weight 1.  */
+static list<pair<string, float> > share_weights;
+
+/* A submitter's list starts with its most urgent job, the lists with
+   more urgent jobs go first whatever the share of their submitter.  */
+struct ShareOrder {
+    explicit ShareOrder(time_t _now)
+        : now(_now) {}
+
+    bool operator()(const UnansweredList *a, const UnansweredList *b) const
+    {
+        CompileJob::Priority pa = a->l.front()->priority();
+        CompileJob::Priority pb = b->l.front()->priority();
+
+        if (pa != pb) {
+            return pa > pb;
+        }
+
+        return a->submitter->shareUsage(now) / a->submitter->shareWeight()
+               < b->submitter->shareUsage(now) / b->submitter->shareWeight();
+    }
+
+    time_t now;
+};
+
+/* The compile time JOB is expected to take, charged to the share of its
+   submitter until the real time is known.  */
+static float expected_msec(const Job *job)
+{
+    if (farm_speed.value() > 0 && job->expectedWork() > 0) {
+        return job->expectedWork() / farm_speed.value();
+    }
+
+    if (!all_job_stats.empty()) {
+        return float(cum_job_stats.compileTimeUser()) / all_job_stats.size();
+    }
+
+    return 0;
+}
+
+/* Queue the jobs of a submitter by their expected cost, largest first,
+   instead of in the order they came in. The submitters still take turns.  */
+static bool longest_first = false;
+// How long a job may be overtaken by larger ones.
+static const time_t LONGEST_FIRST_MAX_DELAY = 10;
+
+/* Whether JOB is to be handed out before QUEUED of the same submitter:
+   more urgent jobs always are, with longest_first also larger ones of the
+   same priority, unless QUEUED has waited too long already.  */
+static bool goes_before(const Job *job, const Job *queued, time_t now)
+{
+    if (job->priority() != queued->priority()) {
+        return job->priority() > queued->priority();
+    }
+
+    return longest_first
+           && job->expectedWork() > queued->expectedWork()
+           && queued->queuedOnScheduler() + LONGEST_FIRST_MAX_DELAY > now;
+}
+
+/* Puts JOB before the first job of the same submitter it goes before, or
+   with longest_first at the end of the submitter's last list.  */
+static bool enqueue_in_order(Job *job, time_t now)
+{
+    UnansweredList *last = 0;
+
+    for (list<UnansweredList *>::iterator it = toanswer.begin(); it != toanswer.end(); ++it) {
+        if ((*it)->submitter != job->submitter()) {
+            continue;
+        }
+
+        list<Job *> &l = (*it)->l;
+
+        for (list<Job *>::iterator pos = l.begin(); pos != l.end(); ++pos) {
+            if (goes_before(job, *pos, now)) {
+                l.insert(pos, job);
+                return true;
+            }
+        }
+
+        last = *it;
+    }
+
+    if (longest_first && last) {
+        last->l.push_back(job);
+        return true;
+    }
+
+    return false;
+}
+
 static void enqueue_job_request(Job *job)
 {
+    queue_changed = true;
+    job->setQueuedOnScheduler(time(0));
+
+    if (enqueue_in_order(job, job->queuedOnScheduler())) {
+        return;
+    }
+
     if (!toanswer.empty() && toanswer.back()->submitter == job->submitter()) {
         toanswer.back()->l.push_back(job);
     } else {
@@ -417,6 +888,67 @@ static void remove_job_request(void)
     }
 }
 
+/* CS may be able to take more jobs now (a slot was freed, its load
+   dropped, it logged in or finished installing an environment). Waiting
+   jobs are only looked at again if CS could run the next job of one of the
+   queues, jobs blocked on some other platform, preferred host or version
+   stay parked. Without CS something changed for all servers.  */
+static void capacity_changed(CompileServer *cs)
+{
+    if (queue_changed) {
+        return;
+    }
+
+    if (!cs) {
+        queue_changed = !toanswer.empty();
+        return;
+    }
+
+    for (list<UnansweredList *>::const_iterator it = toanswer.begin(); it != toanswer.end(); ++it) {
+        Job *job = (*it)->l.front();
+
+        if (!job->preferredHost().empty() && !cs->matches(job->preferredHost())) {
+            continue;
+        }
+
+        if (cs == job->submitter() || cs->is_eligible_now(job)) {
+            queue_changed = true;
+            return;
+        }
+    }
+}
+
+/* A job parked because no server had the memory for it goes anywhere
+   MAX_MEMORY_WAIT after it was queued, see CompileServer::can_hold(). Looks
+   at the queue again when that happened since the last call and returns
+   the seconds until it happens next.  */
+static time_t last_memory_wait_check = 0;
+
+static time_t check_memory_waits()
+{
+    time_t now = time(0);
+    time_t next = MAX_SCHEDULER_PING;
+
+    for (list<UnansweredList *>::const_iterator it = toanswer.begin(); it != toanswer.end(); ++it) {
+        Job *job = (*it)->l.front();
+
+        if (!job->expectedMemory()) {
+            continue;
+        }
+
+        time_t expiry = job->queuedOnScheduler() + CompileServer::MAX_MEMORY_WAIT + 1;
+
+        if (expiry > now) {
+            next = min(next, expiry - now);
+        } else if (expiry > last_memory_wait_check) {
+            queue_changed = true;
+        }
+    }
+
+    last_memory_wait_check = now;
+    return next;
+}
+
 static string dump_job(Job *job);
 
 static bool handle_cs_request(MsgChannel *cs, Msg *_m)
@@ -431,6 +963,10 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
 
     submitter->setClientCount(m->client_count);
 
+    if (m->env_size) {
+        avg_env_size = avg_env_size ? 0.9 * avg_env_size + 0.1 * m->env_size : m->env_size;
+    }
+
     Job *master_job = 0;
 
     for (unsigned int i = 0; i < m->count; ++i) {
@@ -463,12 +999,17 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
         job->setPreferredHost(m->preferred_host);
         job->setMinimalHostVersion(m->minimal_host_version);
         job->setRequiredFeatures(m->required_features);
+        job->setAcceptsDuplicate(m->count == 1 && (m->flags & GetCSMsg::AcceptsDuplicates));
+        job->setPriority(CompileJob::Priority(min(m->priority, uint32_t(CompileJob::Priority_Urgent))));
+        job->setEnvSize(m->env_size);
+        predict_job_cost(job);
+        add_env_demand(job, time(0));
         enqueue_job_request(job);
         std::ostream &dbg = log_info();
         dbg << "NEW " << job->id() << " client="
             << submitter->nodeName() << " versions=[";
 
-        Environments envs = job->environments();
+        const Environments &envs = job->environments();
 
         for (Environments::const_iterator it = envs.begin();
                 it != envs.end();) {
@@ -521,43 +1062,6 @@ static bool handle_local_job_done(CompileServer *cs, Msg *_m)
     return true;
 }
 
-/* Given a candidate CS and a JOB, check all installed environments
-   on the CS for a match.  Return an empty string if none of the required
-   environments for this job is installed.  Otherwise return the
-   host platform of the first found installed environment which is among
-   the requested.  That can be send to the client, which then completely
-   specifies which environment to use (name, host platform and target
-   platform).  */
-static string envs_match(CompileServer *cs, const Job *job)
-{
-    if (job->submitter() == cs) {
-        return cs->hostPlatform();    // it will compile itself
-    }
-
-    Environments compilerVersions = cs->compilerVersions();
-
-    /* Check all installed envs on the candidate CS ...  */
-    for (Environments::const_iterator it = compilerVersions.begin();
-            it != compilerVersions.end(); ++it) {
-        if (it->first == job->targetPlatform()) {
-            /* ... IT now is an installed environment which produces code for
-               the requested target platform.  Now look at each env which
-               could be installed from the client (i.e. those coming with the
-               job) if it matches in name and additionally could be run
-               by the candidate CS.  */
-            Environments environments = job->environments();
-            for (Environments::const_iterator it2 = environments.begin();
-                    it2 != environments.end(); ++it2) {
-                if (it->second == it2->second && cs->platforms_compatible(it2->first)) {
-                    return it2->first;
-                }
-            }
-        }
-    }
-
-    return string();
-}
-
 static CompileServer *pick_server(Job *job)
 {
 #if DEBUG_SCHEDULER > 1
@@ -570,8 +1074,8 @@ static CompileServer *pick_server(Job *job)
     for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
         CompileServer *cs = *it;
 
-        list<Job *> jobList = cs->jobList();
-        for (list<Job *>::const_iterator it2 = jobList.begin(); it2 != jobList.end(); ++it2) {
+        const vector<Job *> &jobList = cs->jobList();
+        for (vector<Job *>::const_iterator it2 = jobList.begin(); it2 != jobList.end(); ++it2) {
             assert(jobs.find((*it2)->id()) != jobs.end());
         }
     }
@@ -582,7 +1086,7 @@ static CompileServer *pick_server(Job *job)
 
         if (j->state() == Job::COMPILING) {
             CompileServer *cs = j->server();
-            list<Job *> jobList = cs->jobList();
+            const vector<Job *> &jobList = cs->jobList();
             assert(find(jobList.begin(), jobList.end(), j) != jobList.end());
         }
     }
@@ -626,221 +1130,254 @@ static CompileServer *pick_server(Job *job)
         return 0;
     }
 
-    CompileServer *best = 0;
-    // best uninstalled
-    CompileServer *bestui = 0;
-    // best preloadable host
-    CompileServer *bestpre = 0;
+    return server_index.pick(job, css.size());
+}
 
-    uint matches = 0;
+/* Prunes the list of connected servers by those which haven't
+   answered for a long time. Return the number of seconds when
+   we have to cleanup next time. */
+static time_t prune_servers()
+{
+    list<CompileServer *>::iterator it;
 
-    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
-        CompileServer *cs = *it;
+    time_t now = time(0);
+    time_t min_time = MAX_SCHEDULER_PING;
 
-        // Ignore ineligible servers
-        if (!cs->is_eligible_now(job)) {
-#if DEBUG_SCHEDULER > 1
-            if ((int(cs->jobList().size()) >= cs->maxJobs() + c->maxPreloadJobs()) || (cs->load() >= 1000)) {
-                trace() << "overloaded " << cs->nodeName() << " " << cs->jobList().size() << "/"
-                        <<  cs->maxJobs() << " jobs, load:" << cs->load() << endl;
-            else
-                trace() << cs->nodeName() << " not eligible" << endl;
-#endif
+    for (it = controls.begin(); it != controls.end();) {
+        if ((now - (*it)->last_talk) >= MAX_SCHEDULER_PING) {
+            CompileServer *old = *it;
+            ++it;
+            handle_end(old, 0);
             continue;
         }
 
-        // incompatible architecture or busy installing
-        if (!cs->can_install(job).size()) {
-#if DEBUG_SCHEDULER > 2
-            trace() << cs->nodeName() << " can't install " << job->id() << endl;
-#endif
-            continue;
-        }
+        min_time = min(min_time, MAX_SCHEDULER_PING - now + (*it)->last_talk);
+        ++it;
+    }
 
-        /* Don't use non-chroot-able daemons for remote jobs.  XXX */
-        if (!cs->chrootPossible() && cs != job->submitter()) {
-            trace() << cs->nodeName() << " can't use chroot\n";
-            continue;
+    for (it = css.begin(); it != css.end();) {
+        bool was_accepting = (*it)->acceptingInConnection();
+        (*it)->startInConnectionTest();
+        if (!was_accepting && (*it)->acceptingInConnection()) {
+            capacity_changed(*it);
         }
 
-        // Check if remote & if remote allowed
-        if (!cs->check_remote(job)) {
-            trace() << cs->nodeName() << " fails remote job check\n";
-            continue;
+        time_t cs_in_conn_timeout = (*it)->getNextTimeout();
+        if(cs_in_conn_timeout != -1)
+        {
+            min_time = min(min_time, cs_in_conn_timeout);
         }
 
+        // The client may have given up seeding, that's no reason to drop the server.
+        if ((*it)->seeding()) {
+            time_t seed_wait = max(MIN_SEED_WAIT, time_t(SEED_OVERDUE_FACTOR
+                                   * install_msec(*it, float((*it)->installBytes())) / 1000));
 
-#if DEBUG_SCHEDULER > 1
-        trace() << cs->nodeName() << " compiled " << cs->lastCompiledJobs().size() << " got now: " <<
-                cs->jobList().size() << " speed: " << server_speed(cs, job, true) << " compile time " <<
-                cs->cumCompiled().compileTimeUser() << " produced code " << cs->cumCompiled().outputSize() <<
-                " client count: " << cs->clientCount() << endl;
-#endif
-
-        if ((cs->lastCompiledJobs().size() == 0) && (cs->jobList().size() == 0) && cs->maxJobs()) {
-            /* Make all servers compile a job at least once, so we'll get an
-               idea about their speed.  */
-            if (!envs_match(cs, job).empty()) {
-                best = cs;
-                matches++;
+            if (now - (*it)->busyInstalling() >= seed_wait) {
+                trace() << "seeding " << (*it)->nodeName() << " did not finish" << endl;
+                (*it)->setSeeding(false);
+                (*it)->setInstallBytes(0);
+                (*it)->setBusyInstalling(0);
+                capacity_changed(*it);
             } else {
-                // if there is one server that already got the environment and one that
-                // hasn't compiled at all, pick the one with environment first
-                bestui = cs;
+                min_time = min(min_time, seed_wait - now + (*it)->busyInstalling());
             }
+        }
 
-            break;
+        if ((*it)->busyInstalling() && ((now - (*it)->busyInstalling()) >= MAX_BUSY_INSTALLING)) {
+            trace() << "busy installing for a long time - removing " << (*it)->nodeName() << endl;
+            CompileServer *old = *it;
+            ++it;
+            handle_end(old, 0);
+            continue;
         }
 
-        /* Distribute 5% of our jobs to servers which haven't been picked in a
-           long time. This gives us a chance to adjust the server speed rating,
-           which may change due to external influences out of our control. */
-        if (!cs->lastPickedId() ||
-            ((job->id() - cs->lastPickedId()) > (20 * css.size()))) {
-            best = cs;
-            break;
+        /* protocol version 27 and newer use TCP keepalive */
+        if (IS_PROTOCOL_27(*it)) {
+            ++it;
+            continue;
         }
 
-        if (!envs_match(cs, job).empty()) {
-            if (!best) {
-                best = cs;
-            }
-            /* Search the server with the earliest projected time to compile
-               the job.  (XXX currently this is equivalent to the fastest one)  */
-            else if ((best->lastCompiledJobs().size() != 0)
-                     && (server_speed(best, job) < server_speed(cs, job))) {
-                if (int(cs->jobList().size()) < cs->maxJobs()) {
-                    best = cs;
-                } else {
-                    bestpre = cs;
+        if ((now - (*it)->last_talk) >= MAX_SCHEDULER_PING) {
+            if ((*it)->maxJobs() >= 0) {
+                trace() << "send ping " << (*it)->nodeName() << endl;
+                (*it)->setMaxJobs((*it)->maxJobs() * -1);   // better not give it away
+
+                if ((*it)->send_msg(PingMsg())) {
+                    // give it MAX_SCHEDULER_PONG to answer a ping
+                    (*it)->last_talk = time(0) - MAX_SCHEDULER_PING
+                                       + 2 * MAX_SCHEDULER_PONG;
+                    min_time = min(min_time, (time_t) 2 * MAX_SCHEDULER_PONG);
+                    ++it;
+                    continue;
                 }
             }
 
-            matches++;
+            // R.I.P.
+            trace() << "removing " << (*it)->nodeName() << endl;
+            CompileServer *old = *it;
+            ++it;
+            handle_end(old, 0);
+            continue;
         } else {
-            if (!bestui) {
-                bestui = cs;
-            }
-            /* Search the server with the earliest projected time to compile
-               the job.  (XXX currently this is equivalent to the fastest one)  */
-            else if ((bestui->lastCompiledJobs().size() != 0)
-                     && (server_speed(bestui, job) < server_speed(cs, job))) {
-                if (int(cs->jobList().size()) < cs->maxJobs()) {
-                    bestui = cs;
-                } else {
-                    bestpre = cs;
-                }
-            }
+            min_time = min(min_time, MAX_SCHEDULER_PING - now + (*it)->last_talk);
         }
-    }
 
-    if (best) {
 #if DEBUG_SCHEDULER > 1
-        trace() << "taking best installed " << best->nodeName() << " " <<  server_speed(best, job, true) << endl;
+        if ((random() % 400) < 0) {
+            // R.I.P.
+            trace() << "FORCED removing " << (*it)->nodeName() << endl;
+            CompileServer *old = *it;
+            ++it;
+            handle_end(old, 0);
+            continue;
+        }
 #endif
-        return best;
-    }
 
-    if (bestui) {
-#if DEBUG_SCHEDULER > 1
-        trace() << "taking best uninstalled " << bestui->nodeName() << " " <<  server_speed(bestui, job, true) << endl;
-#endif
-        return bestui;
+        ++it;
     }
 
-    if (bestpre) {
-#if DEBUG_SCHEDULER > 1
-        trace() << "taking best preload " << bestpre->nodeName() << " " <<  server_speed(bestpre, job, true) << endl;
-#endif
-    }
+    return min_time;
+}
 
-    return bestpre;
+/* Replaces the estimated share usage charged for JOB when it was assigned
+   by what it really used, before it goes away.  */
+static void settle_share_usage(Job *job, float used_msec)
+{
+    if (job->chargedMsec() != used_msec) {
+        job->submitter()->addShareUsage(used_msec - job->chargedMsec(), time(0));
+        job->setChargedMsec(used_msec);
+    }
 }
 
-/* Prunes the list of connected servers by those which haven't
-   answered for a long time. Return the number of seconds when
-   we have to cleanup next time. */
-static time_t prune_servers()
+/* Tells the submitter of JOB to compile it on CS. If the submitter can't
+   be reached it is ended, together with its jobs.  */
+static void assign_job(Job *job, CompileServer *cs)
 {
-    list<CompileServer *>::iterator it;
+    job->setState(Job::WAITINGFORCS);
+    job->setServer(cs);
+    job->setChargedMsec(expected_msec(job));
+    job->submitter()->addShareUsage(job->chargedMsec(), time(0));
 
-    time_t now = time(0);
-    time_t min_time = MAX_SCHEDULER_PING;
+    string host_platform = cs->envs_match(job);
+    bool gotit = true;
 
-    for (it = controls.begin(); it != controls.end();) {
-        if ((now - (*it)->last_talk) >= MAX_SCHEDULER_PING) {
-            CompileServer *old = *it;
-            ++it;
-            handle_end(old, 0);
-            continue;
+    if (host_platform.empty()) {
+        gotit = false;
+        host_platform = cs->can_install(job);
+    }
+
+    // mix and match between job ids
+    unsigned matched_job_id = 0;
+    unsigned count = 0;
+
+    const RingBuffer<JobStat> &lastRequestedJobs = job->submitter()->lastRequestedJobs();
+    for (RingBuffer<JobStat>::const_iterator l = lastRequestedJobs.begin();
+            l != lastRequestedJobs.end(); ++l) {
+        unsigned rcount = 0;
+
+        const RingBuffer<JobStat> &lastCompiledJobs = cs->lastCompiledJobs();
+        for (RingBuffer<JobStat>::const_iterator r = lastCompiledJobs.begin();
+                r != lastCompiledJobs.end(); ++r) {
+            if (l->jobId() == r->jobId()) {
+                matched_job_id = l->jobId();
+            }
+
+            if (++rcount > 16) {
+                break;
+            }
         }
 
-        min_time = min(min_time, MAX_SCHEDULER_PING - now + (*it)->last_talk);
-        ++it;
+        if (matched_job_id || (++count > 16)) {
+            break;
+        }
+    }
+    if(IS_PROTOCOL_37(job->submitter()) && cs == job->submitter())
+    {
+        NoCSMsg m2(job->id(), job->localClientId());
+        if (!job->submitter()->send_msg(m2)) {
+            trace() << "failed to deliver job " << job->id() << endl;
+            handle_end(job->submitter(), 0);   // will care for the rest
+            return;
+        }
+    }
+    else
+    {
+        UseCSMsg m2(host_platform, cs->name, cs->remotePort(), job->id(),
+                gotit, job->localClientId(), matched_job_id);
+        m2.expected_memory = job->expectedMemory();
+        m2.env_installing = gotit && cs != job->submitter() && cs->installs_env(job);
+        // the submitting daemon passes the dictionaries on to the client
+        if (IS_PROTOCOL_44(cs) && IS_PROTOCOL_44(job->submitter())) {
+            m2.source_dict_id = source_dict_id;
+            m2.object_dict_id = object_dict_id;
+        }
+
+        if (CompileServer *seed = seed_target(job, cs)) {
+            m2.seed_host = seed->name;
+            m2.seed_port = seed->remotePort();
+            m2.seed_platform = seed->can_install(job);
+            log_info() << "SEED " << seed->nodeName() << " with " << m2.seed_platform
+                       << " environment of " << job->id() << endl;
+            last_seed = time(0);
+            seed->setSeeding(true);
+            seed->setInstallBytes(job->envSize());
+            /* No installingEnv(), the seed may never come and jobs for the
+               environment must not count on it.  */
+            seed->setBusyInstalling(last_seed);
+        }
+        if (!job->submitter()->send_msg(m2)) {
+            trace() << "failed to deliver job " << job->id() << endl;
+            handle_end(job->submitter(), 0);   // will care for the rest
+            return;
+        }
     }
 
-    for (it = css.begin(); it != css.end();) {
-        (*it)->startInConnectionTest();
-        time_t cs_in_conn_timeout = (*it)->getNextTimeout();
-        if(cs_in_conn_timeout != -1)
-        {
-            min_time = min(min_time, cs_in_conn_timeout);
-        }
 
-        if ((*it)->busyInstalling() && ((now - (*it)->busyInstalling()) >= MAX_BUSY_INSTALLING)) {
-            trace() << "busy installing for a long time - removing " << (*it)->nodeName() << endl;
-            CompileServer *old = *it;
-            ++it;
-            handle_end(old, 0);
-            continue;
-        }
+#if DEBUG_SCHEDULER >= 0
+    if (!gotit) {
+        trace() << "put " << job->id() << " in joblist of " << cs->nodeName() << " (will install now)" << endl;
+    } else {
+        trace() << "put " << job->id() << " in joblist of " << cs->nodeName() << endl;
+    }
+#endif
+    /* Time from here until the job begins there, unless it has to wait
+       for a slot or the environment; that sizes the preload window.  */
+    if (gotit && cs != job->submitter() && int(cs->jobList().size()) < cs->maxJobs()) {
+        job->setAssignedMsec(now_msec());
+    } else {
+        job->setAssignedMsec(0);
+    }
 
-        /* protocol version 27 and newer use TCP keepalive */
-        if (IS_PROTOCOL_27(*it)) {
-            ++it;
-            continue;
-        }
+    cs->appendJob(job);
 
-        if ((now - (*it)->last_talk) >= MAX_SCHEDULER_PING) {
-            if ((*it)->maxJobs() >= 0) {
-                trace() << "send ping " << (*it)->nodeName() << endl;
-                (*it)->setMaxJobs((*it)->maxJobs() * -1);   // better not give it away
+    /* if it doesn't have the environment, it will get it. */
+    if (!gotit) {
+        cs->setBusyInstalling(time(0));
+        cs->setInstallBytes(job->envSize());
+        cs->setInstallingEnv(job_environment(job, host_platform));
+    }
 
-                if ((*it)->send_msg(PingMsg())) {
-                    // give it MAX_SCHEDULER_PONG to answer a ping
-                    (*it)->last_talk = time(0) - MAX_SCHEDULER_PING
-                                       + 2 * MAX_SCHEDULER_PONG;
-                    min_time = min(min_time, (time_t) 2 * MAX_SCHEDULER_PONG);
-                    ++it;
-                    continue;
-                }
-            }
+    string env;
 
-            // R.I.P.
-            trace() << "removing " << (*it)->nodeName() << endl;
-            CompileServer *old = *it;
-            ++it;
-            handle_end(old, 0);
-            continue;
-        } else {
-            min_time = min(min_time, MAX_SCHEDULER_PING - now + (*it)->last_talk);
+    if (!job->masterJobFor().empty()) {
+        const Environments &environments = job->environments();
+        for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+            if (it->first == cs->hostPlatform()) {
+                env = it->second;
+                break;
+            }
         }
+    }
 
-#if DEBUG_SCHEDULER > 1
-        if ((random() % 400) < 0) {
-            // R.I.P.
-            trace() << "FORCED removing " << (*it)->nodeName() << endl;
-            CompileServer *old = *it;
-            ++it;
-            handle_end(old, 0);
-            continue;
+    if (!env.empty()) {
+        const list<Job *> &masterJobFor = job->masterJobFor();
+        for (list<Job *>::const_iterator it = masterJobFor.begin(); it != masterJobFor.end(); ++it) {
+            // remove all other environments
+            (*it)->clearEnvironments();
+            (*it)->appendEnvironment(make_pair(cs->hostPlatform(), env));
         }
-#endif
-
-        ++it;
     }
-
-    return min_time;
 }
 
 static Job *delay_current_job()
@@ -859,6 +1396,12 @@ static Job *delay_current_job()
 
 static bool empty_queue()
 {
+    /* The submitters take turns by how much of the farm they used
+       recently, the one that used the least for its weight first.  */
+    if (toanswer.size() > 1) {
+        toanswer.sort(ShareOrder(time(0)));
+    }
+
     Job *job = get_job_request();
 
     if (!job) {
@@ -909,100 +1452,115 @@ static bool empty_queue()
     }
 
     remove_job_request();
+    assign_job(job, cs);
+    return true;
+}
 
-    job->setState(Job::WAITINGFORCS);
-    job->setServer(cs);
+/* A job that took STRAGGLER_FACTOR times as long as expected, and at least
+   MIN_STRAGGLER_SECONDS, is compiled on another server too if one is
+   idle. The client takes the result that is there first and cancels the
+   other job.  */
+static const float STRAGGLER_FACTOR = 3;
+static const time_t MIN_STRAGGLER_SECONDS = 20;
+static const time_t STRAGGLER_CHECK_INTERVAL = 5;
+static time_t last_straggler_check = 0;
 
-    string host_platform = envs_match(cs, job);
-    bool gotit = true;
+static CompileJob::Language job_language(const Job *job)
+{
+    for (int lang = CompileJob::Lang_C; lang <= CompileJob::Lang_Custom; ++lang) {
+        ostringstream name;
+        name << CompileJob::Language(lang);
 
-    if (host_platform.empty()) {
-        gotit = false;
-        host_platform = cs->can_install(job);
+        if (name.str() == job->language()) {
+            return CompileJob::Language(lang);
+        }
     }
 
-    // mix and match between job ids
-    unsigned matched_job_id = 0;
-    unsigned count = 0;
+    return CompileJob::Lang_Custom;
+}
 
-    list<JobStat> lastRequestedJobs = job->submitter()->lastRequestedJobs();
-    for (list<JobStat>::const_iterator l = lastRequestedJobs.begin();
-            l != lastRequestedJobs.end(); ++l) {
-        unsigned rcount = 0;
+static void duplicate_job(Job *job, time_t now)
+{
+    Job *dup = create_new_job(job->submitter());
+    dup->setEnvironments(job->environments());
+    dup->setTargetPlatform(job->targetPlatform());
+    dup->setArgFlags(job->argFlags());
+    dup->setLanguage(job->language());
+    dup->setFileName(job->fileName());
+    dup->setLocalClientId(job->localClientId());
+    dup->setMinimalHostVersion(job->minimalHostVersion());
+    dup->setRequiredFeatures(job->requiredFeatures());
+    dup->setExpectedCost(job->expectedWork(), job->expectedTransfer());
+    dup->setDuplicateId(job->id());
+    dup->setPriority(job->priority());
+    dup->setEnvSize(job->envSize());
+
+    CompileServer *cs = pick_server(dup);
+
+    // Only a server that can start it right away is of any help.
+    if (!cs || cs == job->server() || cs == job->submitter()
+            || int(cs->jobList().size()) >= cs->maxJobs()) {
+        jobs.erase(dup->id());
+        delete dup;
+        return;
+    }
 
-        list<JobStat> lastCompiledJobs = cs->lastCompiledJobs();
-        for (list<JobStat>::const_iterator r = lastCompiledJobs.begin();
-                r != lastCompiledJobs.end(); ++r) {
-            if (l->jobId() == r->jobId()) {
-                matched_job_id = l->jobId();
-            }
+    job->setDuplicateId(dup->id());
+    log_info() << "DUPLICATE " << job->id() << " running for " << now - job->startOnScheduler()
+               << "s on " << job->server()->nodeName() << " as " << dup->id() << " on "
+               << cs->nodeName() << endl;
 
-            if (++rcount > 16) {
-                break;
-            }
-        }
+    GetCSMsg m(Environments(), dup->fileName(), job_language(dup), 1, dup->targetPlatform(), 0,
+               string(), 0, 0, dup->submitter()->clientCount());
+    notify_monitors(new MonGetCSMsg(dup->id(), dup->submitter()->hostId(), &m));
+    assign_job(dup, cs);
+}
 
-        if (matched_job_id || (++count > 16)) {
-            break;
-        }
-    }
-    if(IS_PROTOCOL_37(job->submitter()) && cs == job->submitter())
-    {
-        NoCSMsg m2(job->id(), job->localClientId());
-        if (!job->submitter()->send_msg(m2)) {
-            trace() << "failed to deliver job " << job->id() << endl;
-            handle_end(job->submitter(), 0);   // will care for the rest
-            return true;
-        }
-    }
-    else
-    {
-        UseCSMsg m2(host_platform, cs->name, cs->remotePort(), job->id(),
-                gotit, job->localClientId(), matched_job_id);
-        if (!job->submitter()->send_msg(m2)) {
-            trace() << "failed to deliver job " << job->id() << endl;
-            handle_end(job->submitter(), 0);   // will care for the rest
-            return true;
-        }
+/* Looks for jobs that take much longer than expected, like on a server
+   that got overloaded, when no job is waiting for a server.  */
+static void duplicate_stragglers()
+{
+    time_t now = time(0);
+
+    if (now - last_straggler_check < STRAGGLER_CHECK_INTERVAL) {
+        return;
     }
 
+    last_straggler_check = now;
 
-#if DEBUG_SCHEDULER >= 0
-    if (!gotit) {
-        trace() << "put " << job->id() << " in joblist of " << cs->nodeName() << " (will install now)" << endl;
-    } else {
-        trace() << "put " << job->id() << " in joblist of " << cs->nodeName() << endl;
+    if (!toanswer.empty()) {
+        return;
     }
-#endif
-    cs->appendJob(job);
 
-    /* if it doesn't have the environment, it will get it. */
-    if (!gotit) {
-        cs->setBusyInstalling(time(0));
-    }
+    vector<unsigned int> stragglers;
 
-    string env;
+    for (map<unsigned int, Job *>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        Job *job = it->second;
 
-    if (!job->masterJobFor().empty()) {
-        Environments environments = job->environments();
-        for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
-            if (it->first == cs->hostPlatform()) {
-                env = it->second;
-                break;
-            }
+        if (job->state() != Job::COMPILING || !job->acceptsDuplicate() || job->duplicateId()
+                || job->server() == job->submitter() || !job->preferredHost().empty()
+                || now - job->startOnScheduler() < MIN_STRAGGLER_SECONDS) {
+            continue;
         }
-    }
 
-    if (!env.empty()) {
-        list<Job *> masterJobFor = job->masterJobFor();
-        for (list<Job *>::iterator it = masterJobFor.begin(); it != masterJobFor.end(); ++it) {
-            // remove all other environments
-            (*it)->clearEnvironments();
-            (*it)->appendEnvironment(make_pair(cs->hostPlatform(), env));
+        /* The load of the server includes the straggler itself, and is
+           what made it slow in the first place.  */
+        float speed = model_speed(job->server(), job);
+
+        if (speed > 0 && job->expectedWork() > 0
+                && 1000.0 * (now - job->startOnScheduler()) > STRAGGLER_FACTOR * job->expectedWork() / speed) {
+            stragglers.push_back(it->first);
         }
     }
 
-    return true;
+    // Assigning a job may end its submitter and the jobs with it.
+    for (vector<unsigned int>::const_iterator it = stragglers.begin(); it != stragglers.end(); ++it) {
+        map<unsigned int, Job *>::const_iterator job = jobs.find(*it);
+
+        if (job != jobs.end() && !job->second->duplicateId()) {
+            duplicate_job(job->second, now);
+        }
+    }
 }
 
 static bool handle_login(CompileServer *cs, Msg *_m)
@@ -1026,6 +1584,14 @@ static bool handle_login(CompileServer *cs, Msg *_m)
         cs->setNodeName(cs->name);
     }
 
+    for (list<pair<string, float> >::const_iterator it = share_weights.begin();
+            it != share_weights.end(); ++it) {
+        if (cs->matches(it->first)) {
+            cs->setShareWeight(it->second);
+            break;
+        }
+    }
+
     cs->setHostPlatform(m->host_platform);
     cs->setChrootPossible(m->chroot_possible);
     cs->setSupportedFeatures(m->supported_features);
@@ -1059,12 +1625,24 @@ static bool handle_login(CompileServer *cs, Msg *_m)
     }
 
     css.push_back(cs);
+    server_index.add(cs);
+    capacity_changed(cs);
 
     /* Configure the daemon */
     if (IS_PROTOCOL_24(cs)) {
         cs->send_msg(ConfCSMsg());
     }
 
+    if (IS_PROTOCOL_44(cs)) {
+        if (source_dict_id) {
+            cs->send_msg(CompressionDictMsg(source_dict));
+        }
+
+        if (object_dict_id) {
+            cs->send_msg(CompressionDictMsg(object_dict));
+        }
+    }
+
     return true;
 }
 
@@ -1077,8 +1655,20 @@ static bool handle_relogin(MsgChannel *mc, Msg *_m)
     }
 
     CompileServer *cs = static_cast<CompileServer *>(mc);
+
+    // The daemon logs in again once it installed the environment.
+    if (cs->busyInstalling() && cs->installBytes()) {
+        time_t now = time(0);
+        float rate = cs->installBytes() / (1000.0 * max(now - cs->busyInstalling(), time_t(1)));
+        cs->addInstallRate(rate, now);
+        farm_install_rate.add(rate, now);
+    }
+
     cs->setCompilerVersions(m->envs);
+    cs->setInstallBytes(0);
+    cs->setSeeding(false);
     cs->setBusyInstalling(0);
+    capacity_changed(cs);
 
     std::ostream &dbg = trace();
     dbg << "RELOGIN " << cs->nodeName() << "(" << cs->hostPlatform() << "): [";
@@ -1139,6 +1729,11 @@ static bool handle_job_begin(CompileServer *cs, Msg *_m)
 
     cs->setClientCount(m->client_count);
 
+    if (job->assignedMsec()) {
+        cs->addDispatchTime(now_msec() - job->assignedMsec(), time(0));
+        job->setAssignedMsec(0);
+    }
+
     job->setState(Job::COMPILING);
     job->setStartTime(m->stime);
     job->setStartOnScheduler(time(0));
@@ -1255,6 +1850,7 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
             << " user=" << m->user_msec
             << " sys=" << m->sys_msec
             << " pfaults=" << m->pfaults
+            << " rss=" << m->peak_rss
             << " server=" << j->server()->nodeName()
             << endl;
     } else {
@@ -1264,9 +1860,21 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
 
     if (j->server()) {
         j->server()->removeJob(j);
+        capacity_changed(j->server());
+    }
+
+    /* The submitter only knows the work of the job if it compiled it
+       itself, otherwise it was cancelled and what the server did so far
+       isn't known.  */
+    if (m->is_from_server() || j->server() == j->submitter()) {
+        settle_share_usage(j, m->user_msec);
+    } else {
+        settle_share_usage(j, 0);
     }
 
+    update_job_memory(j, m);
     add_job_stats(j, m);
+
     notify_monitors(new MonJobDoneMsg(*m));
     jobs.erase(m->job_id);
     delete j;
@@ -1280,6 +1888,7 @@ static bool handle_ping(CompileServer *cs, Msg * /*_m*/)
 
     if (cs->maxJobs() < 0) {
         cs->setMaxJobs(cs->maxJobs() * -1);
+        capacity_changed(cs);
     }
 
     return true;
@@ -1300,12 +1909,21 @@ static bool handle_stats(CompileServer *cs, Msg *_m)
 
         if (cs && (cs->maxJobs() < 0)) {
             cs->setMaxJobs(cs->maxJobs() * -1);
+            capacity_changed(cs);
         }
     }
 
     for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it)
         if (*it == cs) {
+            bool load_dropped = m->load < (*it)->load();
+            bool mem_freed = m->freeMem > (*it)->freeMem();
             (*it)->setLoad(m->load);
+            (*it)->setFreeMem(m->freeMem);
+
+            if (load_dropped || mem_freed) {
+                capacity_changed(*it);
+            }
+
             (*it)->setClientCount(m->client_count);
             handle_monitor_stats(*it, m);
             return true;
@@ -1435,12 +2053,38 @@ static bool handle_line(CompileServer *cs, Msg *_m)
             sprintf(buffer, " (%s:%d) ", (*it)->name.c_str(), (*it)->remotePort());
             line = " " + (*it)->nodeName() + buffer;
             line += "[" + (*it)->hostPlatform() + "] speed=";
-            sprintf(buffer, "%.2f jobs=%d/%d load=%d", server_speed(*it),
-                    (int)(*it)->jobList().size(), (*it)->maxJobs(), (*it)->load());
+            sprintf(buffer, "%.2f jobs=%d/%d load=%d usage=%.0fs", server_speed(*it),
+                    (int)(*it)->jobList().size(), (*it)->maxJobs(), (*it)->load(),
+                    (*it)->shareUsage(time(0)) / 1000);
+            line += buffer;
+
+            if ((*it)->shareWeight() != 1) {
+                sprintf(buffer, " weight=%g", (*it)->shareWeight());
+                line += buffer;
+            }
+
+            sprintf(buffer, " preload=%d", (*it)->maxPreloadCount());
             line += buffer;
 
+            if ((*it)->freeMem()) {
+                sprintf(buffer, " free=%uMB", (*it)->freeMem());
+                line += buffer;
+            }
+
+            if ((*it)->dispatchTime().value() > 0) {
+                sprintf(buffer, " (job=%.0fms dispatch=%.0fms)", (*it)->jobDuration().value(),
+                        (*it)->dispatchTime().value());
+                line += buffer;
+            }
+
+            if ((*it)->installRate().value() > 0) {
+                sprintf(buffer, " install=%.0fkB/s", (*it)->installRate().value() * 1000 / 1024);
+                line += buffer;
+            }
+
             if ((*it)->busyInstalling()) {
-                sprintf(buffer, " busy installing since %ld s",  time(0) - (*it)->busyInstalling());
+                sprintf(buffer, " busy %s since %ld s", (*it)->seeding() ? "seeding" : "installing",
+                        time(0) - (*it)->busyInstalling());
                 line += buffer;
             }
 
@@ -1448,8 +2092,13 @@ static bool handle_line(CompileServer *cs, Msg *_m)
                 return false;
             }
 
-            list<Job *> jobList = (*it)->jobList();
-            for (list<Job *>::const_iterator it2 = jobList.begin(); it2 != jobList.end(); ++it2) {
+            if (!(*it)->speedModel().empty()
+                    && !cs->send_msg(TextMsg("   speeds: " + (*it)->speedModel().describe(time(0))))) {
+                return false;
+            }
+
+            const vector<Job *> &jobList = (*it)->jobList();
+            for (vector<Job *>::const_iterator it2 = jobList.begin(); it2 != jobList.end(); ++it2) {
                 if (!cs->send_msg(TextMsg("   " + dump_job(*it2)))) {
                     return false;
                 }
@@ -1612,6 +2261,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
          the daemon died.  We expect that the daemon dying makes the client
          disconnect soon too.  */
         css.remove(toremove);
+        server_index.remove(toremove);
 
         /* Unfortunately the toanswer queues are also tagged based on the daemon,
            so we need to clean them up also.  */
@@ -1629,6 +2279,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
                         (*jit)->server()->setBusyInstalling(0);
                     }
 
+                    settle_share_usage(*jit, 0);
                     jobs.erase((*jit)->id());
                     delete(*jit);
                 }
@@ -1657,6 +2308,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
                     job->server()->setBusyInstalling(0);
                 }
 
+                settle_share_usage(job, 0);
                 jobs.erase(mit++);
                 delete job;
             } else {
@@ -1668,6 +2320,11 @@ static bool handle_end(CompileServer *toremove, Msg *m)
             (*itr)->eraseCSFromBlacklist(toremove);
         }
 
+        /* Slots of other servers may have been freed, and waiting jobs
+           that only the removed daemon could have run go to their
+           submitters now.  */
+        capacity_changed(0);
+
         break;
     case CompileServer::LINE:
         toremove->send_msg(TextMsg("200 Good Bye!"));
@@ -1818,6 +2475,64 @@ static int open_tcp_listener(short port, const string &interface)
     return fd;
 }
 
+/* Trains a zstd dictionary from the files in DIR, which are split into pieces
+   of the size of file chunks the daemons send. Returns the dictionary id,
+   0 if there are no usable samples.  */
+static uint32_t train_dictionary(const string &dir, string &dict)
+{
+    // ZDICT recommends about 100 times the dictionary size worth of samples
+    const size_t dict_size = 112640;
+    const size_t max_samples_size = 100 * dict_size;
+    const size_t sample_size = 100000;
+
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        log_perror("opendir() for compression samples");
+        return 0;
+    }
+
+    string samples;
+    vector<size_t> sizes;
+    vector<char> buf(sample_size);
+
+    while (struct dirent *ent = readdir(d)) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        ifstream file((dir + '/' + ent->d_name).c_str(), ios::binary);
+
+        while (samples.size() < max_samples_size && file.read(&buf[0], buf.size()).gcount() > 0) {
+            samples.append(&buf[0], file.gcount());
+            sizes.push_back(file.gcount());
+        }
+    }
+
+    closedir(d);
+
+    if (sizes.size() < 10) {
+        log_warning() << "not enough compression samples in " << dir << endl;
+        return 0;
+    }
+
+    dict.resize(dict_size);
+    size_t ret = ZDICT_trainFromBuffer(&dict[0], dict.size(), samples.data(), &sizes[0], sizes.size());
+
+    if (ZDICT_isError(ret)) {
+        log_error() << "training compression dictionary from " << dir << " failed: "
+                    << ZDICT_getErrorName(ret) << endl;
+        dict.clear();
+        return 0;
+    }
+
+    dict.resize(ret);
+    uint32_t dict_id = ZDICT_getDictID(dict.data(), dict.size());
+    log_info() << "trained compression dictionary " << dict_id << " (" << dict.size() << " bytes) from "
+               << sizes.size() << " samples in " << dir << endl;
+    return dict_id;
+}
+
 static void usage(const char *reason = 0)
 {
     if (reason) {
@@ -1836,6 +2551,10 @@ static void usage(const char *reason = 0)
          << "  -u, --user-uid\n"
          << "  -v[v[v]]]\n"
          << "  -r, --persistent-client-connection\n"
+         << "  -t, --dictionary-samples <dir>\n"
+         << "  -c, --cost-db <file>\n"
+         << "  -L, --longest-first\n"
+         << "  -w, --weight <host>=<weight>\n"
          << endl;
 
     exit(1);
@@ -1903,6 +2622,7 @@ int main(int argc, char *argv[])
     const char *netname = "ICECREAM";
     bool detach = false;
     bool persistent_clients = false;
+    string dictionary_samples;
     int debug_level = Error;
     string logfile;
     uid_t user_uid;
@@ -1936,10 +2656,14 @@ int main(int argc, char *argv[])
             { "daemonize", 0, NULL, 'd'},
             { "log-file", 1, NULL, 'l'},
             { "user-uid", 1, NULL, 'u'},
+            { "dictionary-samples", 1, NULL, 't'},
+            { "cost-db", 1, NULL, 'c'},
+            { "longest-first", 0, NULL, 'L'},
+            { "weight", 1, NULL, 'w'},
             { 0, 0, 0, 0 }
         };
 
-        const int c = getopt_long(argc, argv, "n:i:p:hl:vdru:", long_options, &option_index);
+        const int c = getopt_long(argc, argv, "n:i:p:hl:vdru:t:c:Lw:", long_options, &option_index);
 
         if (c == -1) {
             break;    // eoo
@@ -1955,6 +2679,9 @@ int main(int argc, char *argv[])
         case 'r':
             persistent_clients= true;
             break;
+        case 'L':
+            longest_first = true;
+            break;
         case 'l':
             if (optarg && *optarg) {
                 logfile = optarg;
@@ -2027,6 +2754,36 @@ int main(int argc, char *argv[])
             }
 
             break;
+        case 't':
+
+            if (optarg && *optarg) {
+                dictionary_samples = optarg;
+            } else {
+                usage("Error: -t requires argument");
+            }
+
+            break;
+        case 'c':
+
+            if (optarg && *optarg) {
+                cost_db_path = optarg;
+            } else {
+                usage("Error: -c requires argument");
+            }
+
+            break;
+        case 'w': {
+            string arg = optarg ? optarg : "";
+            string::size_type pos = arg.rfind('=');
+            float weight = pos != string::npos ? atof(arg.c_str() + pos + 1) : 0;
+
+            if (pos == 0 || weight <= 0) {
+                usage("Error: -w requires <host>=<weight> with a positive weight");
+            }
+
+            share_weights.push_back(make_pair(arg.substr(0, pos), weight));
+            break;
+        }
 
         default:
             usage();
@@ -2104,6 +2861,15 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (!dictionary_samples.empty()) {
+        source_dict_id = train_dictionary(dictionary_samples + "/source", source_dict);
+        object_dict_id = train_dictionary(dictionary_samples + "/object", object_dict);
+    }
+
+    if (!cost_db.open(cost_db_path)) {
+        log_warning() << "compile costs are not kept across restarts" << endl;
+    }
+
     starttime = time(0);
     if( getenv( "ICECC_FAKE_STARTTIME" ) != NULL )
         starttime -= 1000;
@@ -2128,10 +2894,20 @@ int main(int argc, char *argv[])
     last_announce = starttime;
 
     while (!exit_main_loop) {
-        int timeout = prune_servers();
+        int timeout = min(prune_servers(), check_memory_waits());
 
-        while (empty_queue()) {
-            continue;
+        if (queue_changed) {
+            queue_changed = false;
+
+            while (empty_queue()) {
+                continue;
+            }
+        }
+
+        duplicate_stragglers();
+
+        if (!jobs.empty()) {
+            timeout = min(timeout, int(STRAGGLER_CHECK_INTERVAL));
         }
 
         /* Announce ourselves from time to time, to make other possible schedulers disconnect
@@ -2354,7 +3130,10 @@ int main(int argc, char *argv[])
                 if(active_fds > 0 && pollfd_is_set(pollfds, (*it)->getInFd(), POLLIN | POLLOUT) && (*it)->isConnected())
                 {
                     active_fds--;
+                    bool was_accepting = (*it)->acceptingInConnection();
                     (*it)->updateInConnectivity(true);
+                    if(!was_accepting)
+                        capacity_changed(*it);
                 }
                 else if((active_fds == 0 || pollfd_is_set(pollfds, (*it)->getInFd(), POLLIN | POLLOUT)) && !(*it)->isConnected())
                 {
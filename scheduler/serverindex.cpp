@@ -0,0 +1,415 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "serverindex.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+
+#include "../services/logging.h"
+
+#include "compileserver.h"
+#include "job.h"
+#include "scheduler.h"
+
+bool ServerIndex::Rank::operator<(const Rank &other) const
+{
+    // Servers with a free slot first, then the fastest.
+    if (preload != other.preload) {
+        return !preload;
+    }
+
+    if (score != other.score) {
+        return score > other.score;
+    }
+
+    return seq < other.seq;
+}
+
+/* How many of the fastest servers without a free slot are compared when
+   looking for the one finishing a job first.  */
+static const int MAX_PRELOAD_CANDIDATES = 8;
+
+ServerIndex::ServerIndex(ScoreFunc score, FinishFunc finish)
+    : m_score(score)
+    , m_finish(finish)
+    , m_seq(0)
+{
+}
+
+void ServerIndex::add(CompileServer *cs)
+{
+    Entry &entry = m_entries[cs];
+    entry.rank.seq = ++m_seq;
+    entry.rank.cs = cs;
+    cs->setIndex(this);
+    reindex(cs, entry);
+}
+
+void ServerIndex::remove(CompileServer *cs)
+{
+    map<CompileServer *, Entry>::iterator it = m_entries.find(cs);
+
+    if (it == m_entries.end()) {
+        return;
+    }
+
+    unindex(it->second);
+    m_entries.erase(it);
+    m_dirty.erase(std::remove(m_dirty.begin(), m_dirty.end(), cs), m_dirty.end());
+    cs->setIndex(0);
+}
+
+void ServerIndex::markDirty(CompileServer *cs)
+{
+    map<CompileServer *, Entry>::iterator it = m_entries.find(cs);
+
+    if (it == m_entries.end() || it->second.dirty) {
+        return;
+    }
+
+    it->second.dirty = true;
+    m_dirty.push_back(cs);
+}
+
+void ServerIndex::refresh()
+{
+    for (vector<CompileServer *>::const_iterator it = m_dirty.begin(); it != m_dirty.end(); ++it) {
+        map<CompileServer *, Entry>::iterator eit = m_entries.find(*it);
+
+        if (eit != m_entries.end() && eit->second.dirty) {
+            eit->second.dirty = false;
+            reindex(*it, eit->second);
+        }
+    }
+
+    m_dirty.clear();
+}
+
+void ServerIndex::unindex(Entry &entry)
+{
+    if (!entry.indexed) {
+        return;
+    }
+
+    map<NameId, Platform>::iterator pit = m_platforms.find(entry.platform);
+    assert(pit != m_platforms.end());
+    Platform &platform = pit->second;
+    platform.servers.erase(entry.rank);
+    platform.fresh.erase(entry.rank.seq);
+    platform.by_last_pick.erase(make_pair(entry.last_picked, entry.rank.seq));
+
+    if (platform.servers.empty()) {
+        m_platforms.erase(pit);
+    }
+
+    for (vector<EnvKey>::const_iterator it = entry.envs.begin(); it != entry.envs.end(); ++it) {
+        map<EnvKey, Bucket>::iterator bit = m_installed.find(*it);
+
+        if (bit == m_installed.end()) {
+            continue;
+        }
+
+        bit->second.erase(entry.rank);
+
+        if (bit->second.empty()) {
+            m_installed.erase(bit);
+        }
+    }
+
+    entry.indexed = false;
+}
+
+void ServerIndex::reindex(CompileServer *cs, Entry &entry)
+{
+    unindex(entry);
+
+    int jobs = cs->jobList().size();
+
+    /* Only what can take a remote job now, the submitter of a job is
+       looked at separately in pick(). A server busy installing only takes
+       jobs for the environments it has or gets, and none for preloading.  */
+    if (cs->maxJobs() <= 0
+            || cs->noRemote()
+            || !cs->chrootPossible()
+            || !cs->acceptingInConnection()
+            || cs->load() >= 1000
+            || jobs >= cs->maxJobs() + (cs->busyInstalling() ? 0 : cs->maxPreloadCount())) {
+        return;
+    }
+
+    entry.platform = cs->hostPlatformId();
+    entry.envs = cs->compilerVersionIds();
+
+    if (cs->busyInstalling() && cs->installingEnv().second && IS_PROTOCOL_51(cs)) {
+        entry.envs.push_back(cs->installingEnv());
+    }
+
+    entry.rank.preload = jobs >= cs->maxJobs();
+    entry.rank.score = m_score(cs, 0);
+    entry.fresh = jobs == 0 && cs->lastCompiledJobs().empty();
+    entry.last_picked = cs->lastPickedId();
+    entry.indexed = true;
+
+    Platform &platform = m_platforms[entry.platform];
+    platform.servers.insert(entry.rank);
+
+    if (entry.fresh) {
+        platform.fresh[entry.rank.seq] = cs;
+    }
+
+    platform.by_last_pick[make_pair(entry.last_picked, entry.rank.seq)] = cs;
+
+    for (vector<EnvKey>::const_iterator it = entry.envs.begin(); it != entry.envs.end(); ++it) {
+        m_installed[*it].insert(entry.rank);
+    }
+}
+
+/* All servers of a platform share the host platform, so whether any
+   environment of the job can run there can be checked on any of them.  */
+bool ServerIndex::platform_usable(const Platform &platform, const Job *job) const
+{
+    if (platform.servers.empty()) {
+        return false;
+    }
+
+    CompileServer *cs = platform.servers.begin()->cs;
+    const EnvironmentIds &environments = job->environmentIds();
+
+    for (EnvironmentIds::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        if (cs->platforms_compatible(it->first)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+unsigned int ServerIndex::login_seq(CompileServer *cs) const
+{
+    map<CompileServer *, Entry>::const_iterator it = m_entries.find(cs);
+    return it != m_entries.end() ? it->second.rank.seq : 0;
+}
+
+/* Background jobs are not preloaded, they only go where a slot is free so
+   that they never hold up other jobs.  */
+bool ServerIndex::can_take(CompileServer *cs, const Job *job) const
+{
+    if (job->priority() == CompileJob::Priority_Background
+            && int(cs->jobList().size()) >= cs->maxJobs()) {
+        return false;
+    }
+
+    return cs->is_eligible_now(job);
+}
+
+/* Returns the projected finish of CS without the delay, no slower server
+   can be done before that.  */
+float ServerIndex::consider(CompileServer *cs, Job *job, Choice &best) const
+{
+    float delay = 0;
+    float finish = m_finish(cs, job, &delay);
+
+    if (!best.cs || finish < best.finish) {
+        best.cs = cs;
+        best.finish = finish;
+    }
+
+    return finish - delay;
+}
+
+/* Of the servers in BUCKET that can take JOB now, the one projected to have
+   it done first. The ones with a free slot come by speed, a slower one only
+   wins if the faster ones are held up, e.g. by installing the environment,
+   so they are looked at until the best one is done before the next one could
+   even compile it. Of those where the job would be preloaded only the
+   fastest few are worth looking at.  */
+void ServerIndex::pick_from(const Bucket &bucket, Job *job, bool installed, Choice &best) const
+{
+    CompileServer *submitter = job->submitter();
+    Bucket::const_iterator it = bucket.begin();
+    int preloads = 0;
+
+    while (it != bucket.end()) {
+        CompileServer *cs = it->cs;
+
+        if (it->preload && (++preloads > MAX_PRELOAD_CANDIDATES
+                            || job->priority() == CompileJob::Priority_Background)) {
+            break;
+        }
+
+        if (cs == submitter || !can_take(cs, job) || (installed && cs->envs_match(job).empty())) {
+            ++it;
+            continue;
+        }
+
+        float undelayed = consider(cs, job, best);
+
+        if (it->preload || best.finish > undelayed) {
+            ++it;
+        } else {
+            Rank first_preload;
+            first_preload.preload = true;
+            first_preload.score = FLT_MAX;
+            it = bucket.lower_bound(first_preload);
+        }
+    }
+}
+
+CompileServer *ServerIndex::pick(Job *job, size_t servers)
+{
+    refresh();
+
+    CompileServer *submitter = job->submitter();
+    bool submitter_ok = can_take(submitter, job);
+    vector<const Platform *> usable;
+
+    /* Make all servers compile a job at least once, so we'll get an idea
+       about their speed, and give servers which haven't been picked in a
+       long time a job, so that their rating can adjust to external influences
+       out of our control. The first such server in login order is used.
+       Urgent jobs are not used for that, they go to the best rated server.  */
+    bool exploring = job->priority() != CompileJob::Priority_Urgent;
+    CompileServer *explore = 0;
+    unsigned int explore_seq = 0;
+    // never compiled anything but doesn't have the environment
+    CompileServer *explore_ui = 0;
+    unsigned int explore_ui_seq = 0;
+
+    for (map<NameId, Platform>::const_iterator pit = m_platforms.begin(); pit != m_platforms.end(); ++pit) {
+        const Platform &platform = pit->second;
+
+        if (!platform_usable(platform, job)) {
+            continue;
+        }
+
+        usable.push_back(&platform);
+
+        for (map<unsigned int, CompileServer *>::const_iterator it = platform.fresh.begin();
+                it != platform.fresh.end() && (!explore || it->first < explore_seq); ++it) {
+            CompileServer *cs = it->second;
+
+            if (cs == submitter || !can_take(cs, job)) {
+                continue;
+            }
+
+            if (!cs->envs_match(job).empty()) {
+                explore = cs;
+                explore_seq = it->first;
+                break;
+            }
+
+            if (!explore_ui || it->first < explore_ui_seq) {
+                explore_ui = cs;
+                explore_ui_seq = it->first;
+            }
+        }
+
+        for (map<pair<unsigned int, unsigned int>, CompileServer *>::const_iterator it
+                = platform.by_last_pick.begin(); it != platform.by_last_pick.end(); ++it) {
+            unsigned int last_picked = it->first.first;
+
+            if (last_picked && job->id() - last_picked <= 20 * servers) {
+                break;
+            }
+
+            if ((!explore || it->first.second < explore_seq)
+                    && it->second != submitter && can_take(it->second, job)) {
+                explore = it->second;
+                explore_seq = it->first.second;
+            }
+        }
+    }
+
+    // The submitter isn't necessarily in the index, e.g. when it doesn't take remote jobs.
+    if (submitter_ok) {
+        unsigned int seq = login_seq(submitter);
+        bool fresh = submitter->jobList().empty() && submitter->lastCompiledJobs().empty();
+        bool stale = !submitter->lastPickedId() || job->id() - submitter->lastPickedId() > 20 * servers;
+
+        if ((fresh || stale) && (!explore || seq < explore_seq)) {
+            explore = submitter;
+            explore_seq = seq;
+        }
+    }
+
+    if (explore && exploring) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "taking " << explore->nodeName() << " to rate it" << endl;
+#endif
+        return explore;
+    }
+
+    /* The server projected to have the job done first. The ones that have
+       the environment already are looked at first, the others only win if
+       compiling there is done earlier even after installing it.  */
+    Choice best;
+    set<EnvKey> seen;
+    const EnvironmentIds &environments = job->environmentIds();
+
+    for (EnvironmentIds::const_iterator eit = environments.begin(); eit != environments.end(); ++eit) {
+        EnvKey key(job->targetPlatformId(), eit->second);
+
+        if (!seen.insert(key).second) {
+            continue;
+        }
+
+        map<EnvKey, Bucket>::const_iterator bit = m_installed.find(key);
+
+        if (bit != m_installed.end()) {
+            pick_from(bit->second, job, true, best);
+        }
+    }
+
+    // the submitter always has the environment
+    if (submitter_ok) {
+        consider(submitter, job, best);
+    }
+
+    Choice installed = best;
+
+    for (vector<const Platform *>::const_iterator pit = usable.begin(); pit != usable.end(); ++pit) {
+        pick_from((*pit)->servers, job, false, best);
+    }
+
+    if (installed.cs && best.cs == installed.cs) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "taking best installed " << best.cs->nodeName() << " " << best.finish << endl;
+#endif
+        return best.cs;
+    }
+
+    if (explore_ui && exploring && !installed.cs) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "taking uninstalled " << explore_ui->nodeName() << " to rate it" << endl;
+#endif
+        return explore_ui;
+    }
+
+    if (best.cs) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "taking best uninstalled " << best.cs->nodeName() << " " << best.finish << endl;
+#endif
+        return best.cs;
+    }
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef SERVERINDEX_H
+#define SERVERINDEX_H
+
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "names.h"
+
+class CompileServer;
+class Job;
+
+/* The compile servers that could take a remote job right now, ordered by their
+   speed and bucketed by installed environment and by host platform, so that
+   picking a server for a job does not have to look at every server.
+
+   A server's entry is only recomputed after something it depends on changed
+   (stats, a job assigned or done, a new environment, ...), the CompileServer
+   setters report that through markDirty().  */
+class ServerIndex
+{
+public:
+    /* Rates CS for JOB, higher is better. With JOB 0 it must rate CS for
+       a job submitted by another host, that is what the index is ordered by.  */
+    typedef float (*ScoreFunc)(CompileServer *cs, Job *job);
+    /* Projected time until CS would have JOB done, lower is better. DELAY is
+       set to the part of it that doesn't depend on the speed of CS, like
+       installing the environment.  */
+    typedef float (*FinishFunc)(CompileServer *cs, Job *job, float *delay);
+
+    ServerIndex(ScoreFunc score, FinishFunc finish);
+
+    void add(CompileServer *cs);
+    void remove(CompileServer *cs);
+    void markDirty(CompileServer *cs);
+
+    /* Returns the server to use for JOB or 0 if no server can take it now.
+       SERVERS is the number of all known servers, every server that wasn't
+       given a job in 20 times as many jobs gets one to refresh its rating.  */
+    CompileServer *pick(Job *job, size_t servers);
+
+    size_t size() const
+    {
+        return m_entries.size();
+    }
+
+private:
+    struct Rank {
+        Rank()
+            : preload(false)
+            , score(0)
+            , seq(0)
+            , cs(0) {}
+
+        bool preload; // no free slot, the job would only be preloaded
+        float score;
+        unsigned int seq; // login order
+        CompileServer *cs;
+
+        bool operator<(const Rank &other) const;
+    };
+    typedef std::set<Rank> Bucket;
+    typedef EnvironmentId EnvKey; // target platform, version
+
+    struct Platform {
+        Bucket servers;
+        // never compiled anything and have no job, by login order
+        std::map<unsigned int, CompileServer *> fresh;
+        // by the id of the job they were picked for last, then login order
+        std::map<std::pair<unsigned int, unsigned int>, CompileServer *> by_last_pick;
+    };
+
+    struct Choice {
+        Choice()
+            : cs(0)
+            , finish(0) {}
+
+        CompileServer *cs;
+        float finish;
+    };
+
+    struct Entry {
+        Entry()
+            : indexed(false)
+            , dirty(false)
+            , fresh(false)
+            , last_picked(0)
+            , platform(0) {}
+
+        bool indexed;
+        bool dirty;
+        bool fresh;
+        unsigned int last_picked;
+        Rank rank;
+        NameId platform;
+        std::vector<EnvKey> envs;
+    };
+
+    void refresh();
+    void unindex(Entry &entry);
+    void reindex(CompileServer *cs, Entry &entry);
+    bool platform_usable(const Platform &platform, const Job *job) const;
+    unsigned int login_seq(CompileServer *cs) const;
+    bool can_take(CompileServer *cs, const Job *job) const;
+    float consider(CompileServer *cs, Job *job, Choice &best) const;
+    void pick_from(const Bucket &bucket, Job *job, bool installed, Choice &best) const;
+
+    ScoreFunc m_score;
+    FinishFunc m_finish;
+    unsigned int m_seq;
+    std::map<CompileServer *, Entry> m_entries;
+    std::map<EnvKey, Bucket> m_installed;
+    std::map<NameId, Platform> m_platforms;
+    std::vector<CompileServer *> m_dirty;
+};
+
+#endif
@@ -0,0 +1,146 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "speedmodel.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+
+#include "../services/job.h"
+
+#include "job.h"
+#include "names.h"
+
+using namespace std;
+
+// the newest value has at least 1/16 of the weight
+static const float MAX_WEIGHT = 16;
+// weight left after an hour without new values: 1/e
+static const float DECAY_SECONDS = 3600;
+// less than this and the class falls back to the overall speed
+static const float MIN_CLASS_WEIGHT = 3;
+// values more than 3 times off the average are outliers ...
+static const float OUTLIER_FACTOR = 3;
+// ... once the average of the class is based on some data ...
+static const float MIN_OUTLIER_WEIGHT = 4;
+// ... unless this many come in a row
+static const unsigned int MAX_OUTLIERS = 3;
+
+float DecayingAverage::weight(time_t now) const
+{
+    if (m_weight == 0) {
+        return 0;
+    }
+
+    return m_weight * expf(-float(max(now - m_last, time_t(0))) / DECAY_SECONDS);
+}
+
+void DecayingAverage::add(float value, time_t now)
+{
+    float w = min(weight(now), MAX_WEIGHT - 1) + 1;
+    m_value += (value - m_value) / w;
+    m_weight = w;
+    m_last = now;
+}
+
+SpeedClass speed_class(const Job *job)
+{
+    const EnvironmentIds &envs = job->environmentIds();
+    NameId compiler = envs.empty() ? 0 : envs.front().second;
+    unsigned int flags = 0;
+
+    if (job->argFlags() & (CompileJob::Flag_O | CompileJob::Flag_O2 | CompileJob::Flag_Ol2)) {
+        flags |= 1;
+    }
+
+    if (job->argFlags() & (CompileJob::Flag_g | CompileJob::Flag_g3)) {
+        flags |= 2;
+    }
+
+    return (SpeedClass(compiler) << 32) | (SpeedClass(intern_name(job->language())) << 8) | flags;
+}
+
+string speed_class_name(SpeedClass cls)
+{
+    string name = interned_name((cls >> 8) & 0xffffff);
+    name += cls & 1 ? " -O" : " -O0";
+
+    if (cls & 2) {
+        name += " -g";
+    }
+
+    name += " " + interned_name(cls >> 32);
+    return name;
+}
+
+bool SpeedModel::add(SpeedClass cls, float speed, time_t now)
+{
+    ClassSpeed &entry = m_classes[cls];
+    const DecayingAverage &average = entry.average;
+
+    if (average.weight(now) >= MIN_OUTLIER_WEIGHT && average.value() > 0
+            && (speed > average.value() * OUTLIER_FACTOR || speed < average.value() / OUTLIER_FACTOR)
+            && ++entry.outliers < MAX_OUTLIERS) {
+        return false;
+    }
+
+    entry.outliers = 0;
+    entry.average.add(speed, now);
+    m_overall.add(speed, now);
+    ++m_samples;
+    return true;
+}
+
+float SpeedModel::speed(SpeedClass cls, time_t now) const
+{
+    map<SpeedClass, ClassSpeed>::const_iterator it = m_classes.find(cls);
+
+    if (it != m_classes.end() && it->second.average.weight(now) >= MIN_CLASS_WEIGHT) {
+        return it->second.average.value();
+    }
+
+    return m_overall.value();
+}
+
+string SpeedModel::describe(time_t now) const
+{
+    string line;
+
+    for (map<SpeedClass, ClassSpeed>::const_iterator it = m_classes.begin();
+            it != m_classes.end(); ++it) {
+        const DecayingAverage &average = it->second.average;
+
+        if (average.weight(now) == 0) {
+            continue;
+        }
+
+        char buffer[64];
+        sprintf(buffer, "=%.2f(%.0f)", average.value(), average.weight(now));
+
+        if (!line.empty()) {
+            line += " ";
+        }
+
+        line += speed_class_name(it->first) + buffer;
+    }
+
+    return line;
+}
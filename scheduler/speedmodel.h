@@ -0,0 +1,114 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef SPEEDMODEL_H
+#define SPEEDMODEL_H
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+class Job;
+
+/* An average where recent values count more: each value has at least
+   1/MAX_WEIGHT of the weight, and older values lose weight over time, so
+   a node that wasn't used for hours is re-learned quickly.  */
+class DecayingAverage
+{
+public:
+    DecayingAverage()
+        : m_value(0)
+        , m_weight(0)
+        , m_last(0) {}
+
+    void add(float value, time_t now);
+
+    float value() const
+    {
+        return m_value;
+    }
+
+    // how much data the average is based on, decayed
+    float weight(time_t now) const;
+
+private:
+    float m_value;
+    float m_weight;
+    time_t m_last;
+};
+
+/* What kind of job it is for the speed model: the compiler (the environment
+   used), the language and whether it's optimized and with debug info.
+   Jobs of one class take about the same time per output byte on a node.  */
+typedef uint64_t SpeedClass;
+
+SpeedClass speed_class(const Job *job);
+std::string speed_class_name(SpeedClass cls);
+
+/* Compile speeds in output bytes per user millisecond, per job class and
+   overall. Values far off the known average of their class are rejected as
+   outliers, unless several in a row are, then the speed has really changed.  */
+class SpeedModel
+{
+public:
+    SpeedModel()
+        : m_samples(0) {}
+
+    // Returns false if SPEED was rejected as an outlier.
+    bool add(SpeedClass cls, float speed, time_t now);
+
+    bool empty() const
+    {
+        return m_samples == 0;
+    }
+
+    unsigned int samples() const
+    {
+        return m_samples;
+    }
+
+    float overall() const
+    {
+        return m_overall.value();
+    }
+
+    /* The speed for jobs of class CLS, the overall speed if there is not
+       enough data for the class. */
+    float speed(SpeedClass cls, time_t now) const;
+
+    // A line like "C++ -O gcc.tar.gz=123.4(20) C -g gcc.tar.gz=98.7(3)".
+    std::string describe(time_t now) const;
+
+private:
+    struct ClassSpeed {
+        ClassSpeed()
+            : outliers(0) {}
+
+        DecayingAverage average;
+        unsigned int outliers; // rejected in a row
+    };
+
+    DecayingAverage m_overall;
+    std::map<SpeedClass, ClassSpeed> m_classes;
+    unsigned int m_samples;
+};
+
+#endif
@@ -63,13 +63,21 @@ static const char *hstrerror(int err) {
 #include <netdb.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #endif
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/time.h>
 #include <string>
 #include <iostream>
+#include <list>
+#include <map>
+#include <vector>
 #include <assert.h>
 #include <lzo/lzo1x.h>
 #include <zstd.h>
@@ -94,7 +102,7 @@ using namespace std;
 #define ZSTD_COMPRESSBOUND(n) ZSTD_compressBound(n)
 #endif
 
-static int zstd_compression()
+static int read_zstd_compression()
 {
     const char *level = getenv("ICECC_COMPRESSION");
     if (!level || !*level)
@@ -107,14 +115,83 @@ static int zstd_compression()
     return n;
 }
 
+static int zstd_compression()
+{
+    static const int level = read_zstd_compression();
+    return level;
+}
+
+// The level is adapted to the link, unless set explicitly.
+static bool adaptive_compression()
+{
+    const char *level = getenv("ICECC_COMPRESSION");
+    static const bool adaptive = !level || !*level;
+    return adaptive;
+}
+
+/*
+ * With adaptive compression, the zstd level is moved up when sending takes
+ * considerably longer than compressing, and down when it's the other way around.
+ * If sending the data uncompressed would be faster than compressing it, chunks
+ * are sent as C_STORED, with one chunk in ADAPTIVE_PROBE_CHUNKS compressed again
+ * to find out if it's still the case. The level reached is remembered per peer,
+ * one-shot clients get it from the daemon (see CompressionLevelMsg).
+ *
+ * Writing to the socket only copies into the kernel's send buffer, so the time
+ * for sending is how fast the peer takes the data out of it. That can only be
+ * measured while data is waiting in it, when the link keeps up with us the
+ * level stays as it is.
+ */
+#define MAX_ADAPTIVE_ZSTD_LEVEL 9
+#define ADAPTIVE_PROBE_CHUNKS 16
+// smaller chunks are not worth measuring
+#define ADAPTIVE_MIN_CHUNK 16 * 1024
+
+static map<string, int> peer_zstd_levels;
+
+// Bytes sent on the socket that the peer hasn't taken yet, -1 if unknown.
+static int unsent_bytes(int fd)
+{
+    int queued = -1;
+#if defined(__linux__) && defined(TIOCOUTQ)
+    if (ioctl(fd, TIOCOUTQ, &queued) < 0) {
+        return -1;
+    }
+#elif defined(SO_NWRITE)
+    socklen_t len = sizeof(queued);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_NWRITE, &queued, &len) < 0) {
+        return -1;
+    }
+#else
+    (void) fd;
+#endif
+    return queued;
+}
+
+static double current_secs()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
 /*
  * A generic DoS protection. The biggest messages are of type FileChunk
  * which shouldn't be larger than 100kb. so anything bigger than 10 times
  * of that is definitely fishy, and we must reject it (we're running as root,
  * so be cautious).
+ * Since protocol 46 file chunks may be up to LARGE_CHUNK_SIZE, so for such
+ * peers the limit for them is that plus room for incompressible data and the
+ * header. Other messages keep the small limit.
  */
 
 #define MAX_MSG_SIZE 1 * 1024 * 1024
+#define DEFAULT_CHUNK_SIZE 100000
+// How much a corked channel queues before sending anyway.
+#define MAX_CORKED_SIZE 256 * 1024
+#define LARGE_CHUNK_SIZE 8 * 1024 * 1024
+#define MAX_LARGE_MSG_SIZE 9 * 1024 * 1024
 
 /*
  * On a slow and congested network it's possible for a send call to get starved.
@@ -285,8 +362,22 @@ bool MsgChannel::update_state(void)
             break;
         } else if (inofs - intogo >= 4) {
             (*this) >> inmsglen;
+            size_t max_size = MAX_MSG_SIZE;
 
+            // Only file chunks may be larger, that needs the type after the length.
             if (inmsglen > MAX_MSG_SIZE) {
+                if (inofs - intogo < 4) {
+                    intogo -= 4;
+                    break;
+                }
+
+                uint32_t type;
+                (*this) >> type;
+                intogo -= 4;
+                max_size = max_msg_size((enum MsgType) type);
+            }
+
+            if (inmsglen > max_size) {
                 log_error() << "received a too large message (size " << inmsglen << "), ignoring" << endl;
                 set_error();
                 return false;
@@ -363,30 +454,88 @@ void MsgChannel::writefull(const void *_buf, size_t count)
     msgtogo += count;
 }
 
-static size_t get_max_write_size()
+static bool read_slow_network()
 {
     if( const char* icecc_slow_network = getenv( "ICECC_SLOW_NETWORK" ))
         if( icecc_slow_network[ 0 ] == '1' )
-            return MAX_SLOW_WRITE_SIZE;
+            return true;
+    return false;
+}
+
+static bool slow_network()
+{
+    static bool slow = read_slow_network();
+    return slow;
+}
+
+static size_t get_max_write_size()
+{
+    if (slow_network())
+        return MAX_SLOW_WRITE_SIZE;
     return MAX_MSG_SIZE;
 }
 
+size_t MsgChannel::max_msg_size(enum MsgType type) const
+{
+    return type == M_FILE_CHUNK && IS_PROTOCOL_46(this) ? MAX_LARGE_MSG_SIZE : MAX_MSG_SIZE;
+}
+
+size_t MsgChannel::max_chunk_size() const
+{
+    if (IS_PROTOCOL_46(this) && !slow_network())
+        return LARGE_CHUNK_SIZE;
+    return DEFAULT_CHUNK_SIZE;
+}
+
+/* Sends up to LEN bytes from BUF followed by up to PAYLOAD_LEN bytes from
+   PAYLOAD, with a single system call.  */
+static ssize_t send_buffers(int fd, const char *buf, size_t len,
+                            const char *payload, size_t payload_len, int flags)
+{
+#ifndef _WIN32
+    if (payload_len) {
+        struct iovec iov[2];
+        struct msghdr hdr;
+        int n = 0;
+
+        if (len) {
+            iov[n].iov_base = const_cast<char *>(buf);
+            iov[n].iov_len = len;
+            ++n;
+        }
+
+        iov[n].iov_base = const_cast<char *>(payload);
+        iov[n].iov_len = payload_len;
+        ++n;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = n;
+        return sendmsg(fd, &hdr, flags);
+    }
+#endif
+
+    return send(fd, buf, len, flags);
+}
+
 bool MsgChannel::flush_writebuf(bool blocking)
 {
     const char *buf = msgbuf + msgofs;
     bool error = false;
 
-    while (msgtogo) {
+    while (msgtogo || ext_payload_len) {
         int send_errno;
         static size_t max_write_size = get_max_write_size();
+        size_t len = min(msgtogo, max_write_size);
+        size_t payload_len = min(ext_payload_len, max_write_size - len);
 #ifdef MSG_NOSIGNAL
-        ssize_t ret = send(fd, buf, min( msgtogo, max_write_size ), MSG_NOSIGNAL);
+        ssize_t ret = send_buffers(fd, buf, len, ext_payload, payload_len, MSG_NOSIGNAL);
         send_errno = errno;
 #else
         void (*oldsigpipe)(int);
 
         oldsigpipe = signal(SIGPIPE, SIG_IGN);
-        ssize_t ret = send(fd, buf, min( msgtogo, max_write_size ), 0);
+        ssize_t ret = send_buffers(fd, buf, len, ext_payload, payload_len, 0);
         send_errno = errno;
         signal(SIGPIPE, oldsigpipe);
 #endif
@@ -435,13 +584,20 @@ bool MsgChannel::flush_writebuf(bool blocking)
             break;
         }
 
-        msgtogo -= ret;
-        buf += ret;
+        bytes_written += ret;
+        size_t sent = min(msgtogo, (size_t)ret);
+        msgtogo -= sent;
+        buf += sent;
+        ext_payload += ret - sent;
+        ext_payload_len -= ret - sent;
     }
 
     msgofs = buf - msgbuf;
     chop_output();
     if(error) {
+        // The payload belongs to the caller, never send it later.
+        ext_payload = 0;
+        ext_payload_len = 0;
         set_error();
         return false;
     }
@@ -557,7 +713,244 @@ void MsgChannel::read_environments(Environments &envs)
     }
 }
 
-void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen, size_t &_clen)
+void MsgChannel::read_uint32_list(list<uint32_t> &l, uint32_t max_len)
+{
+    uint32_t len;
+    l.clear();
+    *this >> len;
+
+    while (len-- && inofs < intogo) {
+        uint32_t value;
+        *this >> value;
+
+        if (l.size() < max_len) {
+            l.push_back(value);
+        }
+    }
+}
+
+void MsgChannel::write_uint32_list(const list<uint32_t> &l)
+{
+    *this << (uint32_t) l.size();
+
+    for (list<uint32_t>::const_iterator it = l.begin(); it != l.end(); ++it) {
+        *this << *it;
+    }
+}
+
+ZSTD_CCtx *MsgChannel::get_zstd_cctx()
+{
+    if (!zstd_cctx) {
+        zstd_cctx = ZSTD_createCCtx();
+        assert(zstd_cctx);
+    }
+
+    return zstd_cctx;
+}
+
+ZSTD_DCtx *MsgChannel::get_zstd_dctx()
+{
+    if (!zstd_dctx) {
+        zstd_dctx = ZSTD_createDCtx();
+        assert(zstd_dctx);
+    }
+
+    return zstd_dctx;
+}
+
+void *MsgChannel::get_lzo_wrkmem()
+{
+    if (!lzo_wrkmem) {
+        lzo_wrkmem = malloc(LZO1X_MEM_COMPRESS);
+        assert(lzo_wrkmem);
+    }
+
+    return lzo_wrkmem;
+}
+
+namespace
+{
+struct CompressionDict {
+    std::string data;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+};
+}
+
+// The scheduler trains new dictionaries only rarely, keep just the last few.
+#define MAX_COMPRESSION_DICTS 8
+static map<uint32_t, CompressionDict> compression_dicts;
+static list<uint32_t> compression_dicts_order;
+
+uint32_t CompressionDicts::add(const string &data)
+{
+    uint32_t dict_id = ZSTD_getDictID_fromDict(data.data(), data.size());
+
+    if (!dict_id) {
+        log_error() << "ignoring invalid compression dictionary" << endl;
+        return 0;
+    }
+
+    if (has(dict_id)) {
+        return dict_id;
+    }
+
+    CompressionDict dict;
+    dict.data = data;
+    dict.cdict = 0;
+    dict.ddict = 0;
+
+    if (compression_dicts_order.size() >= MAX_COMPRESSION_DICTS) {
+        map<uint32_t, CompressionDict>::iterator it = compression_dicts.find(compression_dicts_order.front());
+        ZSTD_freeCDict(it->second.cdict);
+        ZSTD_freeDDict(it->second.ddict);
+        compression_dicts.erase(it);
+        compression_dicts_order.pop_front();
+    }
+
+    compression_dicts[dict_id] = dict;
+    compression_dicts_order.push_back(dict_id);
+    trace() << "added compression dictionary " << dict_id << " (" << data.size() << " bytes)" << endl;
+    return dict_id;
+}
+
+bool CompressionDicts::has(uint32_t dict_id)
+{
+    return dict_id && compression_dicts.find(dict_id) != compression_dicts.end();
+}
+
+string CompressionDicts::data(uint32_t dict_id)
+{
+    map<uint32_t, CompressionDict>::const_iterator it = compression_dicts.find(dict_id);
+    return it != compression_dicts.end() ? it->second.data : string();
+}
+
+ZSTD_CDict *CompressionDicts::cdict(uint32_t dict_id)
+{
+    map<uint32_t, CompressionDict>::iterator it = compression_dicts.find(dict_id);
+
+    if (it == compression_dicts.end()) {
+        return 0;
+    }
+
+    CompressionDict &dict = it->second;
+
+    if (!dict.cdict) {
+        dict.cdict = ZSTD_createCDict(dict.data.data(), dict.data.size(), zstd_compression());
+
+        if (!dict.cdict) {
+            log_error() << "failed to load compression dictionary " << dict_id << endl;
+        }
+    }
+
+    return dict.cdict;
+}
+
+ZSTD_DDict *CompressionDicts::ddict(uint32_t dict_id)
+{
+    map<uint32_t, CompressionDict>::iterator it = compression_dicts.find(dict_id);
+
+    if (it == compression_dicts.end()) {
+        return 0;
+    }
+
+    CompressionDict &dict = it->second;
+
+    if (!dict.ddict) {
+        dict.ddict = ZSTD_createDDict(dict.data.data(), dict.data.size());
+
+        if (!dict.ddict) {
+            log_error() << "failed to load decompression dictionary " << dict_id << endl;
+        }
+    }
+
+    return dict.ddict;
+}
+
+/*
+ * Received file chunks come in at a high rate, so their buffers and the
+ * FileChunkMsg objects themselves are recycled instead of going through
+ * the allocator every time. The pool is shared by all channels, a message
+ * may well outlive the channel it came from.
+ */
+#define MAX_POOLED_CHUNK_BUFFERS 8
+#define MAX_POOLED_CHUNK_BYTES (16 * 1024 * 1024)
+#define CHUNK_BUFFER_GRANULARITY (64 * 1024)
+#define MAX_POOLED_CHUNK_MSGS 16
+
+static vector<pair<size_t, unsigned char *> > chunk_buffers;
+static size_t chunk_buffers_bytes = 0;
+static vector<void *> chunk_msgs;
+
+// Returns a buffer for at least LEN bytes, its real size is stored in SIZE.
+static unsigned char *get_chunk_buffer(size_t len, size_t &size)
+{
+    size_t best = chunk_buffers.size();
+
+    for (size_t i = 0; i < chunk_buffers.size(); ++i) {
+        if (chunk_buffers[i].first >= len
+                && (best == chunk_buffers.size() || chunk_buffers[i].first < chunk_buffers[best].first)) {
+            best = i;
+        }
+    }
+
+    if (best != chunk_buffers.size()) {
+        unsigned char *buf = chunk_buffers[best].second;
+        size = chunk_buffers[best].first;
+        chunk_buffers_bytes -= size;
+        chunk_buffers[best] = chunk_buffers.back();
+        chunk_buffers.pop_back();
+        return buf;
+    }
+
+    size = max((len + CHUNK_BUFFER_GRANULARITY - 1) / CHUNK_BUFFER_GRANULARITY, (size_t)1)
+           * CHUNK_BUFFER_GRANULARITY;
+    return new unsigned char[size];
+}
+
+// Gives back a buffer from get_chunk_buffer(), keeping the largest ones.
+static void put_chunk_buffer(unsigned char *buf, size_t size)
+{
+    if (!buf) {
+        return;
+    }
+
+    if (chunk_buffers.capacity() == 0) {
+        chunk_buffers.reserve(MAX_POOLED_CHUNK_BUFFERS);
+    }
+
+    while (!chunk_buffers.empty() && (chunk_buffers.size() >= MAX_POOLED_CHUNK_BUFFERS
+                                      || chunk_buffers_bytes + size > MAX_POOLED_CHUNK_BYTES)) {
+        size_t smallest = 0;
+
+        for (size_t i = 1; i < chunk_buffers.size(); ++i) {
+            if (chunk_buffers[i].first < chunk_buffers[smallest].first) {
+                smallest = i;
+            }
+        }
+
+        if (chunk_buffers[smallest].first >= size) {
+            break;
+        }
+
+        delete[] chunk_buffers[smallest].second;
+        chunk_buffers_bytes -= chunk_buffers[smallest].first;
+        chunk_buffers[smallest] = chunk_buffers.back();
+        chunk_buffers.pop_back();
+    }
+
+    if (chunk_buffers.size() >= MAX_POOLED_CHUNK_BUFFERS
+            || chunk_buffers_bytes + size > MAX_POOLED_CHUNK_BYTES) {
+        delete[] buf;
+        return;
+    }
+
+    chunk_buffers.push_back(make_pair(size, buf));
+    chunk_buffers_bytes += size;
+}
+
+void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen, size_t &_clen,
+                                size_t &_bufsize)
 {
     lzo_uint uncompressed_len;
     lzo_uint compressed_len;
@@ -570,11 +963,12 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
     uint32_t proto = C_LZO;
     if (IS_PROTOCOL_40(this)) {
         *this >> proto;
-        if (proto != C_LZO && proto != C_ZSTD) {
+        if (proto != C_LZO && proto != C_ZSTD && proto != C_ZSTD_STREAM && proto != C_STORED) {
             log_error() << "Unknown compression protocol " << proto << endl;
             *uncompressed_buf = 0;
             _uclen = 0;
             _clen = compressed_len;
+            _bufsize = 0;
             set_error();
             return;
         }
@@ -582,8 +976,9 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
 
     /* If there was some input, but nothing compressed,
        or lengths are bigger than the whole chunk message
-       or we don't have everything to uncompress, there was an error.  */
-    if (uncompressed_len > MAX_MSG_SIZE
+       or we don't have everything to uncompress, there was an error.
+       File chunks are the largest compressed data.  */
+    if (uncompressed_len > max_msg_size(M_FILE_CHUNK)
             || compressed_len > (inofs - intogo)
             || (uncompressed_len && !compressed_len)
             || inofs < intogo + compressed_len) {
@@ -592,29 +987,90 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
         uncompressed_len = 0;
         _uclen = uncompressed_len;
         _clen = compressed_len;
+        _bufsize = 0;
         set_error();
         return;
     }
 
-    *uncompressed_buf = new unsigned char[uncompressed_len];
+    *uncompressed_buf = get_chunk_buffer(uncompressed_len, _bufsize);
 
     if (proto == C_ZSTD && uncompressed_len && compressed_len) {
         const void *compressed_buf = inbuf + intogo;
-        size_t ret = ZSTD_decompress(*uncompressed_buf, uncompressed_len,
-                                     compressed_buf, compressed_len);
+        size_t ret = ZSTD_decompressDCtx(get_zstd_dctx(), *uncompressed_buf, uncompressed_len,
+                                         compressed_buf, compressed_len);
         if (ZSTD_isError(ret)) {
             log_error() << "internal error - decompression of data from " << dump().c_str()
                         << " failed: " << ZSTD_getErrorName(ret) << endl;
-            delete[] *uncompressed_buf;
+            put_chunk_buffer(*uncompressed_buf, _bufsize);
+            _bufsize = 0;
+            *uncompressed_buf = 0;
+            uncompressed_len = 0;
+        }
+    } else if (proto == C_ZSTD_STREAM && uncompressed_len && compressed_len) {
+        if (!zstd_stream_in) {
+            // The frame header at the start of the stream says which dictionary it needs.
+            uint32_t dict_id = ZSTD_getDictID_fromFrame(inbuf + intogo, compressed_len);
+            ZSTD_DDict *ddict = CompressionDicts::ddict(dict_id);
+
+            if (dict_id && !ddict) {
+                log_error() << "data from " << dump().c_str() << " needs unknown compression dictionary "
+                            << dict_id << endl;
+                put_chunk_buffer(*uncompressed_buf, _bufsize);
+                _bufsize = 0;
+                *uncompressed_buf = 0;
+                intogo += compressed_len;
+                _uclen = 0;
+                _clen = compressed_len;
+                set_error();
+                return;
+            }
+
+            ZSTD_DCtx_reset(get_zstd_dctx(), ZSTD_reset_session_only);
+            ZSTD_DCtx_refDDict(zstd_dctx, ddict);
+            zstd_stream_in = true;
+        }
+
+        ZSTD_inBuffer in = { inbuf + intogo, compressed_len, 0 };
+        ZSTD_outBuffer out = { *uncompressed_buf, uncompressed_len, 0 };
+        size_t ret = 0;
+
+        // The sender flushed the stream after this chunk, so all of it is decodable now.
+        while (in.pos < in.size || out.pos < out.size) {
+            size_t in_pos = in.pos;
+            size_t out_pos = out.pos;
+            ret = ZSTD_decompressStream(zstd_dctx, &out, &in);
+
+            if (ZSTD_isError(ret) || (in.pos == in_pos && out.pos == out_pos)) {
+                break;
+            }
+        }
+
+        if (ZSTD_isError(ret) || in.pos != in.size || out.pos != out.size) {
+            log_error() << "internal error - stream decompression of data from " << dump().c_str()
+                        << " failed: " << (ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "bad chunk size")
+                        << endl;
+            put_chunk_buffer(*uncompressed_buf, _bufsize);
+            _bufsize = 0;
+            *uncompressed_buf = 0;
+            uncompressed_len = 0;
+            // the rest of the stream is unusable
+            zstd_stream_in = false;
+        }
+    } else if (proto == C_STORED && uncompressed_len) {
+        if (compressed_len == uncompressed_len) {
+            memcpy(*uncompressed_buf, inbuf + intogo, uncompressed_len);
+        } else {
+            log_error() << "internal error - stored data from " << dump().c_str()
+                        << " has wrong size " << compressed_len << endl;
+            put_chunk_buffer(*uncompressed_buf, _bufsize);
+            _bufsize = 0;
             *uncompressed_buf = 0;
             uncompressed_len = 0;
         }
     } else if (proto == C_LZO && uncompressed_len && compressed_len) {
         const lzo_byte *compressed_buf = (lzo_byte *)(inbuf + intogo);
-        lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
         int ret = lzo1x_decompress(compressed_buf, compressed_len,
-                                   *uncompressed_buf, &uncompressed_len, wrkmem);
-        free(wrkmem);
+                                   *uncompressed_buf, &uncompressed_len, get_lzo_wrkmem());
 
         if (ret != LZO_E_OK) {
             /* This should NEVER happen.
@@ -623,7 +1079,8 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
             that there actually was something read in.  */
             log_error() << "internal error - decompression of data from " << dump().c_str()
                         << " failed: " << ret << endl;
-            delete [] *uncompressed_buf;
+            put_chunk_buffer(*uncompressed_buf, _bufsize);
+            _bufsize = 0;
             *uncompressed_buf = 0;
             uncompressed_len = 0;
         }
@@ -637,18 +1094,120 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
     _clen = compressed_len;
 }
 
-void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, size_t &_out_len)
+uint32_t MsgChannel::pick_compression()
 {
-    uint32_t proto = C_LZO;
+    if (IS_PROTOCOL_45(this) && incompressible_out) {
+        return C_STORED;
+    }
+
+    if (IS_PROTOCOL_45(this) && adaptive_compression() && zstd_level == 0
+            && ++stored_chunks % ADAPTIVE_PROBE_CHUNKS != 0) {
+        return C_STORED;
+    }
+
+    if (IS_PROTOCOL_43(this))
+        return C_ZSTD_STREAM;
     if (IS_PROTOCOL_40(this))
-        proto = C_ZSTD;
+        return C_ZSTD;
+    return C_LZO;
+}
+
+void MsgChannel::adapt_compression()
+{
+    if (!adaptive_compression() || !IS_PROTOCOL_40(this)) {
+        return;
+    }
+
+    int queued = unsent_bytes(fd);
+    double now = current_secs();
+    // The link was busy all the time only if data was waiting at both ends.
+    bool busy = queued > 0 && drain_mark_queued > 0;
+
+    if (busy) {
+        double drained = double(bytes_written - drain_mark_written) - (queued - drain_mark_queued);
+        double secs = now - drain_mark_secs;
+
+        // How long sending takes does not depend on the compression, so average it over all chunks.
+        if (drained > 0 && secs > 0) {
+            double secs_per_byte = secs / drained;
+            send_secs_per_byte = send_secs_per_byte < 0 ? secs_per_byte
+                                 : 0.7 * send_secs_per_byte + 0.3 * secs_per_byte;
+        }
+    }
+
+    drain_mark_secs = now;
+    drain_mark_queued = queued;
+    drain_mark_written = bytes_written;
+
+    if (!busy || send_secs_per_byte < 0 || last_chunk_in < ADAPTIVE_MIN_CHUNK || !last_chunk_out
+            || last_chunk_proto == C_STORED) {
+        return;
+    }
+
+    // all per uncompressed byte
+    double ratio = double(last_chunk_out) / last_chunk_in;
+    double compress_time = last_chunk_secs / last_chunk_in;
+    double send_time = ratio * send_secs_per_byte;
+    int old_level = zstd_level;
+
+    if (IS_PROTOCOL_45(this) && send_secs_per_byte < compress_time + send_time) {
+        zstd_level = 0;
+    } else if (send_time > 2 * compress_time) {
+        zstd_level = max(1, min(zstd_level + 1, MAX_ADAPTIVE_ZSTD_LEVEL));
+    } else if (compress_time > 2 * send_time) {
+        zstd_level = max(1, zstd_level - 1);
+    } else {
+        zstd_level = max(1, zstd_level);
+    }
+
+    if (zstd_level != old_level) {
+        trace() << "compression for " << name << " changed to " << compression_info() << endl;
+    }
+
+    // all unix domain socket peers have the same name
+    if (addr && addr->sa_family != AF_UNIX) {
+        peer_zstd_levels[name] = zstd_level;
+    }
+}
+
+void MsgChannel::set_compression_level(int level)
+{
+    if (adaptive_compression()) {
+        zstd_level = max(0, min(level, MAX_ADAPTIVE_ZSTD_LEVEL));
+    }
+}
+
+string MsgChannel::compression_info() const
+{
+    if (!IS_PROTOCOL_40(this)) {
+        return "lzo";
+    }
+
+    if (zstd_level == 0 && IS_PROTOCOL_45(this) && adaptive_compression()) {
+        return "stored";
+    }
+
+    if (IS_PROTOCOL_44(this) && CompressionDicts::has(out_dict_id)) {
+        return "zstd dictionary " + toString(out_dict_id);
+    }
+
+    return "zstd level " + toString(zstd_level ? zstd_level : 1);
+}
+
+void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, size_t &_out_len)
+{
+    uint32_t proto = pick_compression();
+    int level = adaptive_compression() ? max(zstd_level, 1) : zstd_compression();
+    double start = current_secs();
 
     lzo_uint in_len = _in_len;
     lzo_uint out_len = _out_len;
     if (proto == C_LZO)
         out_len = in_len + in_len / 64 + 16 + 3;
-    else if (proto == C_ZSTD)
+    else if (proto == C_ZSTD || proto == C_ZSTD_STREAM)
         out_len = ZSTD_COMPRESSBOUND(in_len);
+    else if (proto == C_STORED)
+        out_len = in_len;
     *this << in_len;
     size_t msgtogo_old = msgtogo;
     *this << (uint32_t) 0;
@@ -656,7 +1215,14 @@ void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, si
     if (IS_PROTOCOL_40(this))
         *this << proto;
 
-    if (msgtogo + out_len >= msgbuflen) {
+#ifndef _WIN32
+    // Stored data need not be copied, flush_writebuf() sends it from in_buf.
+    bool by_ref = proto == C_STORED && allow_ext_payload;
+#else
+    bool by_ref = false;
+#endif
+
+    if (!by_ref && msgtogo + out_len >= msgbuflen) {
         /* Realloc to a multiple of 128.  */
         msgbuflen = (msgtogo + out_len + 127) & ~(size_t)127;
         msgbuf = (char *) realloc(msgbuf, msgbuflen);
@@ -665,9 +1231,7 @@ void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, si
 
     if (proto == C_LZO) {
         lzo_byte *out_buf = (lzo_byte *)(msgbuf + msgtogo);
-        lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
-        int ret = lzo1x_1_compress(in_buf, in_len, out_buf, &out_len, wrkmem);
-        free(wrkmem);
+        int ret = lzo1x_1_compress(in_buf, in_len, out_buf, &out_len, get_lzo_wrkmem());
 
         if (ret != LZO_E_OK) {
             /* this should NEVER happen */
@@ -676,7 +1240,7 @@ void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, si
         }
     } else if (proto == C_ZSTD) {
         void *out_buf = msgbuf + msgtogo;
-        size_t ret = ZSTD_compress(out_buf, out_len, in_buf, in_len, zstd_compression());
+        size_t ret = ZSTD_compressCCtx(get_zstd_cctx(), out_buf, out_len, in_buf, in_len, level);
         if (ZSTD_isError(ret)) {
             /* this should NEVER happen */
             log_error() << "internal error - compression failed: " << ZSTD_getErrorName(ret) << endl;
@@ -684,14 +1248,85 @@ void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, si
         }
 
         out_len = ret;
+    } else if (proto == C_ZSTD_STREAM) {
+        ZSTD_CCtx *cctx = get_zstd_cctx();
+
+        if (!zstd_stream_out) {
+            ZSTD_CDict *cdict = IS_PROTOCOL_44(this) ? CompressionDicts::cdict(out_dict_id) : 0;
+
+            if (cdict) {
+                ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+                ZSTD_CCtx_refCDict(cctx, cdict);
+            } else {
+                ZSTD_initCStream(cctx, level);
+            }
+
+            zstd_stream_out = true;
+        }
+
+        ZSTD_inBuffer in = { in_buf, in_len, 0 };
+        ZSTD_outBuffer out = { msgbuf + msgtogo, msgbuflen - msgtogo, 0 };
+        size_t ret;
+
+        for (;;) {
+            // Flush at the end, so that the receiver can decompress the chunk on arrival.
+            bool flushing = in.pos == in.size;
+            if (flushing)
+                ret = ZSTD_flushStream(cctx, &out);
+            else
+                ret = ZSTD_compressStream(cctx, &out, &in);
+
+            if (ZSTD_isError(ret) || (flushing && ret == 0)) {
+                break;
+            }
+
+            if (out.pos == out.size) {
+                /* Should not really happen given the compress bound, but
+                   the frame header could still push it over. */
+                msgbuflen = (msgtogo + out.size + ZSTD_CStreamOutSize() + 127) & ~(size_t)127;
+                msgbuf = (char *) realloc(msgbuf, msgbuflen);
+                assert(msgbuf);
+                out.dst = msgbuf + msgtogo;
+                out.size = msgbuflen - msgtogo;
+            }
+        }
+
+        if (ZSTD_isError(ret)) {
+            /* this should NEVER happen */
+            log_error() << "internal error - stream compression failed: " << ZSTD_getErrorName(ret) << endl;
+            out_len = 0;
+            zstd_stream_out = false;
+        } else {
+            out_len = out.pos;
+        }
+
+        /* Already compressed data (e.g. an environment tarball). The stream has
+           consumed this chunk already, so it must go out as it is, but the rest
+           of the file is not worth compressing.  */
+        if (IS_PROTOCOL_45(this) && in_len >= ADAPTIVE_MIN_CHUNK && out_len > in_len / 100 * 97) {
+            incompressible_out = true;
+        }
+    } else if (proto == C_STORED) {
+        if (by_ref) {
+            ext_payload = (const char *)in_buf;
+            ext_payload_len = in_len;
+        } else {
+            memcpy(msgbuf + msgtogo, in_buf, in_len);
+        }
     }
 
+    last_chunk_proto = proto;
+    last_chunk_in = in_len;
+    last_chunk_out = out_len;
+    last_chunk_secs = current_secs() - start;
+
     uint32_t _olen = htonl(out_len);
-    if(out_len > MAX_MSG_SIZE) {
+    if(out_len > max_msg_size(M_FILE_CHUNK)) {
         log_error() << "internal error - size of compressed message to write exceeds max size:" << out_len << endl;
     }
     memcpy(msgbuf + msgtogo_old, &_olen, 4);
-    msgtogo += out_len;
+    if (!by_ref)
+        msgtogo += out_len;
     _out_len = out_len;
 }
 
@@ -849,7 +1484,8 @@ static bool connect_async(int remote_fd, struct sockaddr *remote_addr, size_t re
     return true;
 }
 
-MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int timeout)
+MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int timeout,
+                                   bool fast_open)
 {
     int remote_fd;
     struct sockaddr_in remote_addr;
@@ -858,6 +1494,18 @@ MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int
         return 0;
     }
 
+#ifdef TCP_FASTOPEN_CONNECT
+    if (fast_open) {
+        /* connect() returns right away if we have a cookie for the host, and our
+           protocol version then goes out together with the SYN. Without a cookie
+           this is a normal connect.  */
+        int i = 1;
+        setsockopt(remote_fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (char *) &i, sizeof(i));
+    }
+#else
+    (void) fast_open;
+#endif
+
     if (timeout) {
         if (!connect_async(remote_fd, (struct sockaddr *) &remote_addr, sizeof(remote_addr), timeout)) {
             return 0;    // remote_fd is already closed
@@ -970,6 +1618,10 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     // not using new/delete because of the need of realloc()
     msgbuf = (char *) malloc(128);
     msgbuflen = 128;
+    ext_payload = 0;
+    ext_payload_len = 0;
+    allow_ext_payload = false;
+    corked = false;
     msgofs = 0;
     msgtogo = 0;
     inbuf = (char *) malloc(128);
@@ -980,6 +1632,29 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     text_based = text;
     set_error_recursion = false;
     maximum_remote_protocol = -1;
+    zstd_cctx = 0;
+    zstd_dctx = 0;
+    lzo_wrkmem = 0;
+    zstd_stream_out = false;
+    zstd_stream_in = false;
+    incompressible_out = false;
+    out_dict_id = 0;
+    stored_chunks = 0;
+    last_chunk_proto = C_LZO;
+    last_chunk_in = 0;
+    last_chunk_out = 0;
+    last_chunk_secs = 0;
+    send_secs_per_byte = -1;
+    bytes_written = 0;
+    drain_mark_written = 0;
+    drain_mark_queued = -1;
+    drain_mark_secs = 0;
+
+    if (addr && addr->sa_family != AF_UNIX && peer_zstd_levels.count(name)) {
+        zstd_level = peer_zstd_levels[name];
+    } else {
+        zstd_level = zstd_compression();
+    }
 
     int on = 1;
 
@@ -1070,6 +1745,18 @@ MsgChannel::~MsgChannel()
     if (addr) {
         free(addr);
     }
+
+    if (zstd_cctx) {
+        ZSTD_freeCCtx(zstd_cctx);
+    }
+
+    if (zstd_dctx) {
+        ZSTD_freeDCtx(zstd_dctx);
+    }
+
+    if (lzo_wrkmem) {
+        free(lzo_wrkmem);
+    }
 }
 
 string MsgChannel::dump() const
@@ -1134,6 +1821,50 @@ void MsgChannel::setBulkTransfer()
     setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (const char *) &i, sizeof(i));
 }
 
+static void set_tcp_cork(int fd, bool on)
+{
+    int i = on ? 1 : 0;
+
+#if defined(TCP_CORK)
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, (char *) &i, sizeof(i));
+#elif defined(TCP_NOPUSH)
+    setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, (char *) &i, sizeof(i));
+#else
+    (void) fd;
+    (void) i;
+#endif
+}
+
+void MsgChannel::cork()
+{
+    if (fd < 0 || corked) {
+        return;
+    }
+
+    corked = true;
+    // Also keep the kernel from sending partial frames when the queue
+    // overflows and gets sent before uncork().
+    set_tcp_cork(fd, true);
+}
+
+bool MsgChannel::uncork()
+{
+    if (!corked) {
+        return instate != ERROR;
+    }
+
+    corked = false;
+
+    if (instate == ERROR) {
+        return false;
+    }
+
+    bool ret = flush_writebuf(true);
+    // Clearing the option pushes out what is left.
+    set_tcp_cork(fd, false);
+    return ret;
+}
+
 /* This waits indefinitely (well, TIMEOUT seconds) for a complete
    message to arrive.  Returns false if there was some error.  */
 bool MsgChannel::wait_for_msg(int timeout)
@@ -1313,6 +2044,12 @@ Msg *MsgChannel::get_msg(int timeout, bool eofAllowed)
     case M_BLACKLIST_HOST_ENV:
         m = new BlacklistHostEnvMsg;
         break;
+    case M_COMPRESSION_DICT:
+        m = new CompressionDictMsg;
+        break;
+    case M_COMPRESSION_LEVEL:
+        m = new CompressionLevelMsg;
+        break;
     case M_TIMEOUT:
         break;
     }
@@ -1325,6 +2062,11 @@ Msg *MsgChannel::get_msg(int timeout, bool eofAllowed)
 
     m->fill_from_channel(this);
 
+    // Anything but a file chunk ends a C_ZSTD_STREAM stream.
+    if (type != M_FILE_CHUNK) {
+        zstd_stream_in = false;
+    }
+
     if (!text_based) {
         if( intogo - intogo_old != inmsglen ) {
             log_error() << "internal error - message not read correctly, message size " << inmsglen
@@ -1357,10 +2099,23 @@ bool MsgChannel::send_msg(const Msg &m, int flags)
         m.send_to_channel(this);
     } else {
         *this << (uint32_t) 0;
+        // A file chunk flushed right away may leave its payload in the
+        // caller's buffer, it's still there until send_msg() returns.
+        allow_ext_payload = m.type == M_FILE_CHUNK && (flags & SendBlocking)
+                            && !(flags & SendBulkOnly) && !corked;
         m.send_to_channel(this);
-        uint32_t out_len = msgtogo - msgtogo_old - 4;
-        if(out_len > MAX_MSG_SIZE) {
+        allow_ext_payload = false;
+
+        if (m.type != M_FILE_CHUNK) {
+            zstd_stream_out = false;
+            incompressible_out = false;
+        }
+
+        uint32_t out_len = msgtogo - msgtogo_old - 4 + ext_payload_len;
+        if(out_len > max_msg_size(m.type)) {
             log_error() << "internal error - size of message to write exceeds max size:" << out_len << endl;
+            ext_payload = 0;
+            ext_payload_len = 0;
             set_error();
             return false;
         }
@@ -1372,9 +2127,107 @@ bool MsgChannel::send_msg(const Msg &m, int flags)
         return true;
     }
 
+    if (corked && msgtogo < MAX_CORKED_SIZE) {
+        return true;
+    }
+
+    if (m.type == M_FILE_CHUNK && (flags & SendBlocking)) {
+        if (!flush_writebuf(true)) {
+            return false;
+        }
+
+        adapt_compression();
+        return true;
+    }
+
     return flush_writebuf((flags & SendBlocking));
 }
 
+bool MsgChannel::send_stored_file_chunk(int in_fd, size_t len)
+{
+    assert(IS_PROTOCOL_45(this));
+
+    if (instate == ERROR) {
+        return false;
+    }
+
+    // Any pending data must go first, the payload will not pass through msgbuf.
+    if (!flush_writebuf(true)) {
+        return false;
+    }
+
+    chop_output();
+    // the message length does not include the length field itself
+    *this << (uint32_t)(4 * 4 + len);
+    *this << (uint32_t) M_FILE_CHUNK;
+    *this << (uint32_t) len;
+    *this << (uint32_t) len;
+    *this << (uint32_t) C_STORED;
+
+    if (!flush_writebuf(true)) {
+        return false;
+    }
+
+    static size_t max_write_size = get_max_write_size();
+
+    while (len) {
+#ifdef HAVE_SYS_SENDFILE_H
+        ssize_t ret = sendfile(fd, in_fd, NULL, min(len, max_write_size));
+
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+
+            if (poll(&pfd, 1, 30 * 1000) > 0 || errno == EINTR) {
+                continue;
+            }
+        }
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret > 0) {
+            bytes_written += ret;
+        }
+#else
+        size_t count = min(len, max_write_size);
+
+        if (msgtogo + count >= msgbuflen) {
+            msgbuflen = (msgtogo + count + 127) & ~(size_t)127;
+            msgbuf = (char *) realloc(msgbuf, msgbuflen);
+            assert(msgbuf);
+        }
+
+        ssize_t ret = read(in_fd, msgbuf + msgtogo, count);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret > 0) {
+            msgtogo += ret;
+
+            if (!flush_writebuf(true)) {
+                return false;
+            }
+        }
+#endif
+
+        if (ret <= 0) {
+            // The message is incomplete, there's no recovering from that.
+            log_perror("send_stored_file_chunk()");
+            set_error();
+            return false;
+        }
+
+        len -= ret;
+    }
+
+    return true;
+}
+
 static int get_second_port_for_debug( int port )
 {
     // When running tests, we want to check also interactions between 2 schedulers, but
@@ -1994,6 +2847,9 @@ GetCSMsg::GetCSMsg(const Environments &envs, const std::string &f,
     , minimal_host_version(_minimal_host_version)
     , required_features(_required_features)
     , client_count(_client_count)
+    , flags(0)
+    , priority(CompileJob::Priority_Normal)
+    , env_size(0)
 {
     // These have been introduced in protocol version 42.
     if( required_features & ( NODE_FEATURE_ENV_XZ | NODE_FEATURE_ENV_ZSTD ))
@@ -2041,6 +2897,26 @@ void GetCSMsg::fill_from_channel(MsgChannel *c)
     if (IS_PROTOCOL_42(c)) {
         *c >> required_features;
     }
+
+    flags = 0;
+    if (IS_PROTOCOL_47(c)) {
+        *c >> flags;
+    }
+
+    priority = CompileJob::Priority_Normal;
+    if (IS_PROTOCOL_48(c)) {
+        *c >> priority;
+    }
+
+    env_size = 0;
+    if (IS_PROTOCOL_49(c)) {
+        *c >> env_size;
+    }
+
+    dict_ids.clear();
+    if (IS_PROTOCOL_53(c)) {
+        c->read_uint32_list(dict_ids, MAX_CACHED_DICTS);
+    }
 }
 
 void GetCSMsg::send_to_channel(MsgChannel *c) const
@@ -2071,6 +2947,22 @@ void GetCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_42(c)) {
         *c << required_features;
     }
+
+    if (IS_PROTOCOL_47(c)) {
+        *c << flags;
+    }
+
+    if (IS_PROTOCOL_48(c)) {
+        *c << priority;
+    }
+
+    if (IS_PROTOCOL_49(c)) {
+        *c << env_size;
+    }
+
+    if (IS_PROTOCOL_53(c)) {
+        c->write_uint32_list(dict_ids);
+    }
 }
 
 void UseCSMsg::fill_from_channel(MsgChannel *c)
@@ -2088,6 +2980,38 @@ void UseCSMsg::fill_from_channel(MsgChannel *c)
     } else {
         matched_job_id = 0;
     }
+
+    if (IS_PROTOCOL_44(c)) {
+        *c >> source_dict_id;
+        *c >> object_dict_id;
+    } else {
+        source_dict_id = 0;
+        object_dict_id = 0;
+    }
+
+    if (IS_PROTOCOL_50(c)) {
+        *c >> seed_host;
+        *c >> seed_port;
+        *c >> seed_platform;
+    } else {
+        seed_host = string();
+        seed_port = 0;
+        seed_platform = string();
+    }
+
+    if (IS_PROTOCOL_52(c)) {
+        *c >> expected_memory;
+    } else {
+        expected_memory = 0;
+    }
+
+    if (IS_PROTOCOL_53(c)) {
+        *c >> compression_level;
+        *c >> env_installing;
+    } else {
+        compression_level = 0;
+        env_installing = 0;
+    }
 }
 
 void UseCSMsg::send_to_channel(MsgChannel *c) const
@@ -2103,6 +3027,26 @@ void UseCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_28(c)) {
         *c << matched_job_id;
     }
+
+    if (IS_PROTOCOL_44(c)) {
+        *c << source_dict_id;
+        *c << object_dict_id;
+    }
+
+    if (IS_PROTOCOL_50(c)) {
+        *c << seed_host;
+        *c << seed_port;
+        *c << seed_platform;
+    }
+
+    if (IS_PROTOCOL_52(c)) {
+        *c << expected_memory;
+    }
+
+    if (IS_PROTOCOL_53(c)) {
+        *c << compression_level;
+        *c << env_installing;
+    }
 }
 
 void NoCSMsg::fill_from_channel(MsgChannel *c)
@@ -2176,6 +3120,26 @@ void CompileFileMsg::fill_from_channel(MsgChannel *c)
         job->setOutputFile(outputFile);
         job->setDwarfFissionEnabled(dwarfFissionEnabled);
     }
+    if (IS_PROTOCOL_44(c)) {
+        *c >> output_dict_id;
+    } else {
+        output_dict_id = 0;
+    }
+    if (IS_PROTOCOL_48(c)) {
+        uint32_t priority;
+        *c >> priority;
+        job->setPriority((CompileJob::Priority) priority);
+    }
+    if (IS_PROTOCOL_52(c)) {
+        uint32_t expectedMemory;
+        *c >> expectedMemory;
+        job->setExpectedMemory(expectedMemory);
+    }
+    if (IS_PROTOCOL_53(c)) {
+        uint32_t envInstalling;
+        *c >> envInstalling;
+        job->setEnvInstalling(envInstalling);
+    }
 }
 
 void CompileFileMsg::send_to_channel(MsgChannel *c) const
@@ -2219,6 +3183,18 @@ void CompileFileMsg::send_to_channel(MsgChannel *c) const
         *c << job->outputFile();
         *c << (uint32_t) job->dwarfFissionEnabled();
     }
+    if (IS_PROTOCOL_44(c)) {
+        *c << output_dict_id;
+    }
+    if (IS_PROTOCOL_48(c)) {
+        *c << (uint32_t) job->priority();
+    }
+    if (IS_PROTOCOL_52(c)) {
+        *c << (uint32_t) job->expectedMemory();
+    }
+    if (IS_PROTOCOL_53(c)) {
+        *c << (uint32_t) job->envInstalling();
+    }
 }
 
 // Environments created by icecc-create-env always use the same binary name
@@ -2244,14 +3220,14 @@ CompileJob *CompileFileMsg::takeJob()
 void FileChunkMsg::fill_from_channel(MsgChannel *c)
 {
     if (del_buf) {
-        delete [] buffer;
+        put_chunk_buffer(buffer, buffer_size);
     }
 
     buffer = 0;
     del_buf = true;
 
     Msg::fill_from_channel(c);
-    c->readcompressed(&buffer, len, compressed);
+    c->readcompressed(&buffer, len, compressed, buffer_size);
 }
 
 void FileChunkMsg::send_to_channel(MsgChannel *c) const
@@ -2263,8 +3239,69 @@ void FileChunkMsg::send_to_channel(MsgChannel *c) const
 FileChunkMsg::~FileChunkMsg()
 {
     if (del_buf) {
-        delete [] buffer;
+        put_chunk_buffer(buffer, buffer_size);
+    }
+}
+
+void *FileChunkMsg::operator new(size_t size)
+{
+    if (size == sizeof(FileChunkMsg) && !chunk_msgs.empty()) {
+        void *p = chunk_msgs.back();
+        chunk_msgs.pop_back();
+        return p;
     }
+
+    return ::operator new(size);
+}
+
+void FileChunkMsg::operator delete(void *p, size_t size)
+{
+    if (p && size == sizeof(FileChunkMsg) && chunk_msgs.size() < MAX_POOLED_CHUNK_MSGS) {
+        if (chunk_msgs.capacity() == 0) {
+            chunk_msgs.reserve(MAX_POOLED_CHUNK_MSGS);
+        }
+
+        chunk_msgs.push_back(p);
+        return;
+    }
+
+    ::operator delete(p);
+}
+
+void CompressionDictMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    unsigned char *buffer = 0;
+    size_t len, compressed, size;
+    c->readcompressed(&buffer, len, compressed, size);
+
+    if (buffer) {
+        data.assign((const char *) buffer, len);
+        put_chunk_buffer(buffer, size);
+    } else {
+        data.clear();
+    }
+}
+
+void CompressionDictMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    size_t compressed;
+    c->writecompressed((const unsigned char *) data.data(), data.size(), compressed);
+}
+
+void CompressionLevelMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> host;
+    *c >> level;
+}
+
+void CompressionLevelMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << host;
+    *c << level;
 }
 
 void CompileResultMsg::fill_from_channel(MsgChannel *c)
@@ -2356,6 +3393,7 @@ JobDoneMsg::JobDoneMsg(int id, int exit, unsigned int _flags, unsigned int _clie
     user_msec = 0;
     sys_msec = 0;
     pfaults = 0;
+    peak_rss = 0;
     in_compressed = 0;
     in_uncompressed = 0;
     out_compressed = 0;
@@ -2386,6 +3424,11 @@ void JobDoneMsg::fill_from_channel(MsgChannel *c)
     if (IS_PROTOCOL_39(c)) {
         *c >> client_count;
     }
+    if (IS_PROTOCOL_52(c)) {
+        *c >> peak_rss;
+    } else {
+        peak_rss = 0;
+    }
 }
 
 void JobDoneMsg::send_to_channel(MsgChannel *c) const
@@ -2409,6 +3452,9 @@ void JobDoneMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_39(c)) {
         *c << client_count;
     }
+    if (IS_PROTOCOL_52(c)) {
+        *c << peak_rss;
+    }
 }
 
 void JobDoneMsg::set_unknown_job_client_id( uint32_t clientId )
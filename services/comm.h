@@ -43,7 +43,7 @@ typedef int socklen_t;
 #include "job.h"
 
 // if you increase the PROTOCOL_VERSION, add a macro below and use that
-#define PROTOCOL_VERSION 42
+#define PROTOCOL_VERSION 53
 // if you increase the MIN_PROTOCOL_VERSION, comment out macros below and clean up the code
 #define MIN_PROTOCOL_VERSION 21
 
@@ -52,6 +52,8 @@ typedef int socklen_t;
 #define MAX_SCHEDULER_PING 12 * MAX_SCHEDULER_PONG
 // maximum amount of time in seconds a daemon can be busy installing
 #define MAX_BUSY_INSTALLING 120
+// compression dictionaries a client keeps cached, see GetCSMsg::dict_ids
+#define MAX_CACHED_DICTS 8
 
 #define IS_PROTOCOL_22(c) ((c)->protocol >= 22)
 #define IS_PROTOCOL_23(c) ((c)->protocol >= 23)
@@ -74,6 +76,17 @@ typedef int socklen_t;
 #define IS_PROTOCOL_40(c) ((c)->protocol >= 40)
 #define IS_PROTOCOL_41(c) ((c)->protocol >= 41)
 #define IS_PROTOCOL_42(c) ((c)->protocol >= 42)
+#define IS_PROTOCOL_43(c) ((c)->protocol >= 43)
+#define IS_PROTOCOL_44(c) ((c)->protocol >= 44)
+#define IS_PROTOCOL_45(c) ((c)->protocol >= 45)
+#define IS_PROTOCOL_46(c) ((c)->protocol >= 46)
+#define IS_PROTOCOL_47(c) ((c)->protocol >= 47)
+#define IS_PROTOCOL_48(c) ((c)->protocol >= 48)
+#define IS_PROTOCOL_49(c) ((c)->protocol >= 49)
+#define IS_PROTOCOL_50(c) ((c)->protocol >= 50)
+#define IS_PROTOCOL_51(c) ((c)->protocol >= 51)
+#define IS_PROTOCOL_52(c) ((c)->protocol >= 52)
+#define IS_PROTOCOL_53(c) ((c)->protocol >= 53)
 
 // Terms used:
 // S  = scheduler
@@ -147,12 +160,22 @@ enum MsgType {
     // C --> CS, CS --> S (forwarded from C), to not use given host for given environment
     M_BLACKLIST_HOST_ENV,
     // S --> CS
-    M_NO_CS
+    M_NO_CS,
+    // S --> CS, CS --> C
+    M_COMPRESSION_DICT,
+    // C --> CS, the compression level reached sending to a compile server
+    M_COMPRESSION_LEVEL
 };
 
 enum Compression {
     C_LZO = 0,
-    C_ZSTD = 1
+    C_ZSTD = 1,
+    // One zstd stream spans all consecutive FileChunk messages (i.e. a whole file),
+    // each chunk is flushed so that it can be decompressed on arrival. Any other
+    // message ends the stream.
+    C_ZSTD_STREAM = 2,
+    // Not compressed at all.
+    C_STORED = 3
 };
 
 // The remote node is capable of unpacking environment compressed as .tar.xz .
@@ -162,6 +185,12 @@ const int NODE_FEATURE_ENV_ZSTD = ( 1 << 1 );
 
 class MsgChannel;
 
+// opaque compression contexts, see <zstd.h>
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
 // a list of pairs of host platform, filename
 typedef std::list<std::pair<std::string, std::string> > Environments;
 
@@ -191,6 +220,13 @@ public:
 
     void setBulkTransfer();
 
+    // While corked, sent messages are only queued (up to a limit), and uncork()
+    // sends them together, so that a small job goes out in one write instead
+    // of one per message. Errors may show up only in uncork().
+    void cork();
+    // false <--> error
+    bool uncork();
+
     std::string dump() const;
     // NULL  <--> channel closed or timeout
     // Will warn in log if EOF and !eofAllowed.
@@ -198,6 +234,10 @@ public:
 
     // false <--> error (msg not send)
     bool send_msg(const Msg &, int SendFlags = SendBlocking);
+    // Sends LEN bytes read from FD as an uncompressed (C_STORED) FileChunk message,
+    // without copying them through user space where possible. Only for protocol 45+.
+    // false <--> error, the channel is unusable then
+    bool send_stored_file_chunk(int fd, size_t len);
 
     bool has_msg(void) const
     {
@@ -217,11 +257,37 @@ public:
         return text_based;
     }
 
-    void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen);
+    // Use the given zstd dictionary (see CompressionDicts) for compressing
+    // file chunks sent from now on, 0 means none. The peer must have it too.
+    void set_compression_dict(uint32_t dict_id)
+    {
+        out_dict_id = dict_id;
+    }
+
+    // How file chunks are currently compressed, for debug output.
+    std::string compression_info() const;
+
+    // The adaptive zstd level for file chunks, 0 means C_STORED. Clients
+    // start with the level the daemon remembers for the peer.
+    int compression_level() const
+    {
+        return zstd_level;
+    }
+    void set_compression_level(int level);
+
+    // The biggest FileChunk payload the peer accepts. Peers with protocol 46+
+    // take large chunks unless ICECC_SLOW_NETWORK is set.
+    size_t max_chunk_size() const;
+
+    // BUF gets a pooled buffer of _BUFSIZE bytes, see FileChunkMsg.
+    void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen, size_t &_bufsize);
     void writecompressed(const unsigned char *in_buf,
                          size_t _in_len, size_t &_out_len);
     void write_environments(const Environments &envs);
     void read_environments(Environments &envs);
+    // Keeps at most MAX_LEN of the values, the rest of a longer list is skipped.
+    void read_uint32_list(std::list<uint32_t> &l, uint32_t max_len);
+    void write_uint32_list(const std::list<uint32_t> &l);
     void read_line(std::string &line);
     void write_line(const std::string &line);
 
@@ -259,11 +325,23 @@ protected:
     void chop_output(void);
     bool wait_for_msg(int timeout);
     void set_error(bool silent = false);
+    struct ZSTD_CCtx_s *get_zstd_cctx();
+    struct ZSTD_DCtx_s *get_zstd_dctx();
+    void *get_lzo_wrkmem();
+    uint32_t pick_compression();
+    void adapt_compression();
+    size_t max_msg_size(enum MsgType type) const;
 
     char *msgbuf;
     size_t msgbuflen;
     size_t msgofs;
     size_t msgtogo;
+    // Payload of a stored file chunk that is sent straight from the caller's
+    // buffer after msgbuf, see send_msg().
+    const char *ext_payload;
+    size_t ext_payload_len;
+    bool allow_ext_payload;
+    bool corked;
     char *inbuf;
     size_t inbuflen;
     size_t inofs;
@@ -281,6 +359,33 @@ protected:
     bool eof;
     bool text_based;
 
+    // (de)compression state, allocated on first use and kept for the
+    // whole life of the channel
+    struct ZSTD_CCtx_s *zstd_cctx;
+    struct ZSTD_DCtx_s *zstd_dctx;
+    void *lzo_wrkmem;
+    // a C_ZSTD_STREAM stream is in progress in zstd_cctx resp. zstd_dctx
+    bool zstd_stream_out;
+    bool zstd_stream_in;
+    // the data of the current stream does not compress, send it C_STORED
+    bool incompressible_out;
+    uint32_t out_dict_id;
+
+    // Adaptive compression: the zstd level used, 0 means C_STORED, and
+    // measurements of the last compressed file chunk.
+    int zstd_level;
+    unsigned int stored_chunks;
+    uint32_t last_chunk_proto;
+    size_t last_chunk_in;
+    size_t last_chunk_out;
+    double last_chunk_secs;
+    double send_secs_per_byte;
+    // bytes handed to the kernel, and the state at the last file chunk sent
+    uint64_t bytes_written;
+    uint64_t drain_mark_written;
+    int drain_mark_queued;
+    double drain_mark_secs;
+
 private:
     friend class Service;
 
@@ -290,11 +395,32 @@ private:
     bool set_error_recursion;
 };
 
+// Trained zstd dictionaries known to this process. The scheduler trains them
+// and hands them out with CompressionDictMsg, the id is the zstd dictionary id,
+// which is also stored in every zstd frame compressed using the dictionary.
+// The compression and decompression contexts are only built when first used.
+class CompressionDicts
+{
+public:
+    // Returns the dictionary id, or 0 if the data is not a usable dictionary.
+    static uint32_t add(const std::string &data);
+    static bool has(uint32_t dict_id);
+    // Raw dictionary data, empty if unknown.
+    static std::string data(uint32_t dict_id);
+
+    static struct ZSTD_CDict_s *cdict(uint32_t dict_id);
+    static struct ZSTD_DDict_s *ddict(uint32_t dict_id);
+};
+
 // just convenient functions to create MsgChannels
 class Service
 {
 public:
-    static MsgChannel *createChannel(const std::string &host, unsigned short p, int timeout);
+    // With fast_open the connection uses TCP Fast Open where available, so that
+    // repeated connections to the same host save the round trip of the handshake.
+    // Connection errors may then show up only when talking on the channel.
+    static MsgChannel *createChannel(const std::string &host, unsigned short p, int timeout,
+                                     bool fast_open = false);
     static MsgChannel *createChannel(const std::string &domain_socket);
     static MsgChannel *createChannel(int remote_fd, struct sockaddr *, socklen_t);
 };
@@ -420,12 +546,22 @@ public:
 class GetCSMsg : public Msg
 {
 public:
+    // flags
+    enum {
+        /* The client can take another UseCS message for the job while it
+           is being compiled, for a speculative duplicate of the job.  */
+        AcceptsDuplicates = (1 << 0)
+    };
+
     GetCSMsg()
         : Msg(M_GET_CS)
         , count(1)
         , arg_flags(0)
         , client_id(0)
-        , client_count(0) {}
+        , client_count(0)
+        , flags(0)
+        , priority(CompileJob::Priority_Normal)
+        , env_size(0) {}
 
     GetCSMsg(const Environments &envs, const std::string &f,
              CompileJob::Language _lang, unsigned int _count,
@@ -448,13 +584,24 @@ public:
     int minimal_host_version;
     uint32_t required_features;
     uint32_t client_count; // number of CS -> C connections at the moment
+    uint32_t flags;
+    uint32_t priority; // CompileJob::Priority
+    uint32_t env_size; // bytes of the largest environment tarball, 0 if unknown
+    // compression dictionaries the client has cached, the daemon doesn't send these
+    std::list<uint32_t> dict_ids;
 };
 
 class UseCSMsg : public Msg
 {
 public:
     UseCSMsg()
-        : Msg(M_USE_CS) {}
+        : Msg(M_USE_CS),
+          source_dict_id(0),
+          object_dict_id(0),
+          seed_port(0),
+          expected_memory(0),
+          env_installing(0),
+          compression_level(0) {}
     UseCSMsg(std::string platform, std::string host, unsigned int p, unsigned int id, bool gotit,
              unsigned int _client_id, unsigned int matched_host_jobs)
         : Msg(M_USE_CS),
@@ -464,7 +611,13 @@ public:
           host_platform(platform),
           got_env(gotit),
           client_id(_client_id),
-          matched_job_id(matched_host_jobs) {}
+          matched_job_id(matched_host_jobs),
+          source_dict_id(0),
+          object_dict_id(0),
+          seed_port(0),
+          expected_memory(0),
+          env_installing(0),
+          compression_level(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -476,6 +629,21 @@ public:
     uint32_t got_env;
     uint32_t client_id;
     uint32_t matched_job_id;
+    // compression dictionaries the CS has, for the source sent to it and for the object file
+    uint32_t source_dict_id;
+    uint32_t object_dict_id;
+    /* An idle compile server the client should send the environment for
+       SEED_PLATFORM to in the background, no seeding if the port is 0.  */
+    std::string seed_host;
+    uint32_t seed_port;
+    std::string seed_platform;
+    // peak memory in kB the job needed the last times, 0 if unknown
+    uint32_t expected_memory;
+    // GOT_ENV because the CS is still installing the environment
+    uint32_t env_installing;
+    /* The zstd level earlier clients reached sending to the host, see
+       CompressionLevelMsg, 0 if unknown. Set by the local daemon.  */
+    uint32_t compression_level;
 };
 
 class NoCSMsg : public Msg
@@ -538,6 +706,7 @@ class CompileFileMsg : public Msg
 public:
     CompileFileMsg(CompileJob *j, bool delete_job = false)
         : Msg(M_COMPILE_FILE)
+        , output_dict_id(0)
         , deleteit(delete_job)
         , job(j) {}
 
@@ -552,6 +721,9 @@ public:
     virtual void send_to_channel(MsgChannel *c) const;
     CompileJob *takeJob();
 
+    // compression dictionary the client can decompress the object file with
+    uint32_t output_dict_id;
+
 private:
     std::string remote_compiler_name() const;
 
@@ -566,16 +738,22 @@ public:
         : Msg(M_FILE_CHUNK)
         , buffer(_buffer)
         , len(_len)
-        , del_buf(false) {}
+        , del_buf(false)
+        , buffer_size(0) {}
 
     FileChunkMsg()
         : Msg(M_FILE_CHUNK)
         , buffer(0)
         , len(0)
-        , del_buf(true) {}
+        , del_buf(true)
+        , buffer_size(0) {}
 
     ~FileChunkMsg();
 
+    // Received chunks and their buffers are recycled.
+    static void *operator new(size_t size);
+    static void operator delete(void *p, size_t size);
+
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
 
@@ -585,10 +763,48 @@ public:
     bool del_buf;
 
 private:
+    size_t buffer_size;
+
     FileChunkMsg(const FileChunkMsg &);
     FileChunkMsg &operator=(const FileChunkMsg &);
 };
 
+class CompressionDictMsg : public Msg
+{
+public:
+    CompressionDictMsg()
+        : Msg(M_COMPRESSION_DICT) {}
+
+    CompressionDictMsg(const std::string &_data)
+        : Msg(M_COMPRESSION_DICT)
+        , data(_data) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // zstd dictionary, as created by ZDICT_trainFromBuffer()
+    std::string data;
+};
+
+class CompressionLevelMsg : public Msg
+{
+public:
+    CompressionLevelMsg()
+        : Msg(M_COMPRESSION_LEVEL)
+        , level(0) {}
+
+    CompressionLevelMsg(const std::string &_host, unsigned int _level)
+        : Msg(M_COMPRESSION_LEVEL)
+        , host(_host)
+        , level(_level) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string host;
+    uint32_t level; // zstd level, C_STORED is sent as 1, the client probes again
+};
+
 class CompileResultMsg : public Msg
 {
 public:
@@ -670,6 +886,7 @@ public:
     uint32_t user_msec; /* user time used */
     uint32_t sys_msec; /* system time used */
     uint32_t pfaults; /* page faults */
+    uint32_t peak_rss; /* peak resident memory of the compiler in kB, 0 if unknown */
 
     int exitcode; /* exit code */
 
@@ -62,8 +62,18 @@ public:
         Flag_Ol2 = 0x10
     } Flag;
 
+    // Higher values are served first, see ICECC_PRIORITY.
+    typedef enum {
+        Priority_Background = 0,
+        Priority_Normal = 1,
+        Priority_Urgent = 2
+    } Priority;
+
     CompileJob()
         : m_id(0)
+        , m_priority(Priority_Normal)
+        , m_expected_memory(0)
+        , m_env_installing(false)
         , m_dwarf_fission(false)
         , m_block_rewrite_includes(false)
     {
@@ -181,6 +191,39 @@ public:
         m_flags.append(arg, argumentType);
     }
 
+    void setPriority(Priority priority)
+    {
+        m_priority = priority;
+    }
+
+    Priority priority() const
+    {
+        return m_priority;
+    }
+
+    // Peak memory in kB the scheduler expects the compiler to need, 0 if unknown.
+    void setExpectedMemory(unsigned int kb)
+    {
+        m_expected_memory = kb;
+    }
+
+    unsigned int expectedMemory() const
+    {
+        return m_expected_memory;
+    }
+
+    /* The scheduler sent the job to a server that is still installing the
+       environment, the transfer may reach it after the job.  */
+    void setEnvInstalling(bool installing)
+    {
+        m_env_installing = installing;
+    }
+
+    bool envInstalling() const
+    {
+        return m_env_installing;
+    }
+
     std::string targetPlatform() const
     {
         return m_target_platform;
@@ -208,6 +251,9 @@ private:
     void setTargetPlatform();
 
     unsigned int m_id;
+    Priority m_priority;
+    unsigned int m_expected_memory;
+    bool m_env_installing;
     Language m_language;
     std::string m_compiler_pathname;
     std::string m_compiler_name;
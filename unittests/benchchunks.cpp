@@ -0,0 +1,246 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Microbenchmark for sending FileChunkMsg over a MsgChannel.
+ * Not run by 'make check', build it with 'make benchchunks' and run
+ * ./benchchunks [chunks] [chunk size] [random].
+ *
+ * The first part compares one-shot ZSTD_compress() with compressing using
+ * a reused ZSTD_CCtx, which is what MsgChannel does, the second part pushes
+ * chunks through a real pair of MsgChannels and reports the CPU time the
+ * sending side spent per MB. With 'random' the data is incompressible,
+ * so the chunks are sent stored.
+ */
+
+#include "comm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zstd.h>
+#include <string>
+#include <iostream>
+
+using namespace std;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Something that looks roughly like preprocessed source.
+static void fill_data(unsigned char *buf, size_t len)
+{
+    static const char *const words[] = {
+        "namespace ", "std", "::", "template<typename T> ", "const ", "int ", "return ",
+        "{\n", "}\n", "(", ")", ";\n", "# 1 \"/usr/include/c++/bits/stl_vector.h\"\n",
+        "static_cast<", ">", "operator", "size_t ", "value_type", " & ", "this->"
+    };
+    size_t pos = 0;
+    unsigned int seed = 1;
+
+    while (pos < len) {
+        seed = seed * 1103515245 + 12345;
+        const char *w = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        size_t wlen = min(strlen(w), len - pos);
+        memcpy(buf + pos, w, wlen);
+        pos += wlen;
+    }
+}
+
+static void fill_random(unsigned char *buf, size_t len)
+{
+    unsigned int seed = 1;
+
+    for (size_t pos = 0; pos < len; ++pos) {
+        seed = seed * 1103515245 + 12345;
+        buf[pos] = seed >> 16;
+    }
+}
+
+static double cpu_secs()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0
+           + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+static void bench_contexts(const unsigned char *data, size_t len, int chunks)
+{
+    size_t bound = ZSTD_compressBound(len);
+    unsigned char *out = new unsigned char[bound];
+
+    double start = now();
+    for (int i = 0; i < chunks; ++i) {
+        ZSTD_compress(out, bound, data, len, 1);
+    }
+    double oneshot = now() - start;
+
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    start = now();
+    for (int i = 0; i < chunks; ++i) {
+        ZSTD_compressCCtx(cctx, out, bound, data, len, 1);
+    }
+    double reused = now() - start;
+    ZSTD_freeCCtx(cctx);
+
+    printf("ZSTD_compress():     %8.2f us/chunk\n", oneshot * 1000000 / chunks);
+    printf("ZSTD_compressCCtx(): %8.2f us/chunk\n", reused * 1000000 / chunks);
+    delete[] out;
+}
+
+static int bench_channel(const unsigned char *data, size_t len, int chunks)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        MsgChannel *c = Service::createChannel(fds[1], 0, 0);
+
+        if (!c) {
+            _exit(1);
+        }
+
+        double start = cpu_secs();
+
+        for (int i = 0; i < chunks; ++i) {
+            FileChunkMsg fcmsg(const_cast<unsigned char *>(data), len);
+
+            if (!c->send_msg(fcmsg)) {
+                _exit(1);
+            }
+        }
+
+        c->send_msg(EndMsg());
+        printf("Sender CPU:          %8.2f ms/MB (%s)\n",
+               (cpu_secs() - start) * 1000 / ((double)len * chunks / 1000000),
+               c->compression_info().c_str());
+        fflush(stdout);
+        delete c;
+        _exit(0);
+    }
+
+    close(fds[1]);
+    MsgChannel *c = Service::createChannel(fds[0], 0, 0);
+
+    if (!c) {
+        return 1;
+    }
+
+    size_t compressed = 0;
+    int received = 0;
+    double start = now();
+
+    for (;;) {
+        Msg *msg = c->get_msg(30);
+
+        if (!msg) {
+            break;
+        }
+
+        if (msg->type == M_END) {
+            delete msg;
+            break;
+        }
+
+        if (msg->type == M_FILE_CHUNK) {
+            FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
+
+            if (fcmsg->len != len || !fcmsg->buffer || memcmp(fcmsg->buffer, data, len) != 0) {
+                fprintf(stderr, "chunk %d received corrupted\n", received);
+                delete msg;
+                break;
+            }
+
+            compressed += fcmsg->compressed;
+            ++received;
+        }
+
+        delete msg;
+    }
+
+    double elapsed = now() - start;
+    delete c;
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    if (received != chunks) {
+        fprintf(stderr, "received %d chunks, expected %d\n", received, chunks);
+        return 1;
+    }
+
+    printf("MsgChannel:          %8.2f us/chunk, %.1f MB/s, %d%% compressed size\n",
+           elapsed * 1000000 / chunks, (double)len * chunks / elapsed / 1000000,
+           int(compressed * 100 / (len * chunks)));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int chunks = argc > 1 ? atoi(argv[1]) : 10000;
+    size_t len = argc > 2 ? atoi(argv[2]) : 100000;
+
+    bool random = argc > 3 && strcmp(argv[3], "random") == 0;
+
+    if (chunks <= 0 || len == 0) {
+        fprintf(stderr, "usage: %s [chunks] [chunk size] [random]\n", argv[0]);
+        return 1;
+    }
+
+    unsetenv("ICECC_COMPRESSION");
+    unsetenv("ICECC_SLOW_NETWORK");
+
+    unsigned char *data = new unsigned char[len];
+    if (random) {
+        fill_random(data, len);
+    } else {
+        fill_data(data, len);
+    }
+
+    printf("%d chunks of %zu bytes\n", chunks, len);
+    bench_contexts(data, len, chunks);
+    int ret = bench_channel(data, len, chunks);
+
+    delete[] data;
+    return ret;
+}
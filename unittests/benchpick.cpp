@@ -0,0 +1,285 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Microbenchmark for picking a compile server in the scheduler.
+ * Not run by 'make check', build it with 'make benchpick' and run
+ * ./benchpick [servers] [picks].
+ *
+ * A synthetic farm of mostly busy servers gets jobs assigned, once by
+ * scanning all servers the way pick_server() used to, once through
+ * ServerIndex. Jobs finish and servers report new load in between,
+ * just like in a real scheduler. Besides the time spent picking, the time
+ * for a whole event (pick, finished job with its stats, new load) and the
+ * memory used by the farm are reported.
+ */
+
+#include "scheduler/compileserver.h"
+#include "scheduler/job.h"
+#include "scheduler/serverindex.h"
+
+#include <fcntl.h>
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static long max_rss_kb()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+// Like server_speed() in the scheduler, without the submitter heuristics.
+static float speed(CompileServer *cs, Job *job)
+{
+    if (cs->lastCompiledJobs().size() == 0 || cs->cumCompiled().compileTimeUser() == 0) {
+        return 0;
+    }
+
+    float f = (float)cs->cumCompiled().outputSize() / (float)cs->cumCompiled().compileTimeUser();
+
+    if (!job || job->submitter() != cs) {
+        f *= float(1000 - cs->load()) / 1000;
+    }
+
+    return f * (1.0f - (0.5f * cs->jobList().size() / cs->maxJobs()));
+}
+
+// Compile time only, without the wait for a slot that the scheduler projects.
+static float finish(CompileServer *cs, Job *job, float *delay)
+{
+    *delay = 0;
+    float f = speed(cs, job);
+    return f > 0 ? job->expectedWork() / f : FLT_MAX;
+}
+
+struct Farm {
+    Farm()
+        : index(speed, finish)
+        , submitter(0)
+        , next_job_id(1) {}
+
+    ServerIndex index;
+    vector<CompileServer *> servers;
+    CompileServer *submitter;
+    vector<pair<CompileServer *, Job *> > running;
+    unsigned int next_job_id;
+};
+
+static void add_stat(CompileServer *cs, unsigned int job_id)
+{
+    JobStat st;
+    st.setOutputSize(50000 + random() % 200000);
+    st.setCompileTimeUser(500 + random() % 2000);
+    st.setJobId(job_id);
+    cs->appendCompiledJob(st);
+    cs->setCumCompiled(cs->cumCompiled() + st);
+
+    if (cs->lastCompiledJobs().size() > 200) {
+        cs->setCumCompiled(cs->cumCompiled() - *cs->lastCompiledJobs().begin());
+        cs->popCompiledJob();
+    }
+}
+
+static Job *new_job(Farm &farm)
+{
+    Job *job = new Job(farm.next_job_id++, farm.submitter);
+    job->setTargetPlatform("x86_64");
+    job->appendEnvironment(make_pair(string("x86_64"), string("gcc-12.tar.zst")));
+    job->setExpectedCost(50000 + random() % 200000, 100000);
+    return job;
+}
+
+static void build_farm(Farm &farm, int count, int fd)
+{
+    srandom(1);
+
+    for (int i = 0; i < count; ++i) {
+        CompileServer *cs = new CompileServer(fd, 0, 0, true);
+        Environments envs;
+        bool arm = random() % 10 == 0;
+
+        cs->maximum_remote_protocol = PROTOCOL_VERSION;
+        cs->setHostPlatform(arm ? "aarch64" : "x86_64");
+        cs->setMaxJobs(4 + random() % 13);
+        cs->setChrootPossible(true);
+        cs->setNoRemote(random() % 20 == 0);
+        cs->setLoad(random() % 900);
+
+        if (!arm && random() % 10 < 7) {
+            envs.push_back(make_pair(string("x86_64"), string("gcc-12.tar.zst")));
+        }
+
+        envs.push_back(make_pair(arm ? string("aarch64") : string("x86_64"), string("clang-16.tar.zst")));
+        cs->setCompilerVersions(envs);
+
+        // A full stats window, like after the scheduler ran for a while.
+        for (int j = 0; j < 200; ++j) {
+            add_stat(cs, j);
+        }
+
+        farm.servers.push_back(cs);
+        farm.index.add(cs);
+    }
+
+    farm.submitter = farm.servers[0];
+
+    // Keep the farm busy, only a few slots are free.
+    for (size_t i = 0; i < farm.servers.size(); ++i) {
+        CompileServer *cs = farm.servers[i];
+        int jobs = max(1, cs->maxJobs() - int(random() % 3));
+
+        for (int j = 0; j < jobs; ++j) {
+            Job *job = new_job(farm);
+            cs->appendJob(job);
+            farm.running.push_back(make_pair(cs, job));
+        }
+    }
+}
+
+// The main loop of pick_server() before ServerIndex.
+static CompileServer *scan(Farm &farm, Job *job)
+{
+    CompileServer *best = 0;
+    CompileServer *bestui = 0;
+    CompileServer *bestpre = 0;
+
+    for (vector<CompileServer *>::iterator it = farm.servers.begin(); it != farm.servers.end(); ++it) {
+        CompileServer *cs = *it;
+
+        if (!cs->is_eligible_now(job) || !cs->can_install(job).size()
+                || (!cs->chrootPossible() && cs != job->submitter()) || !cs->check_remote(job)) {
+            continue;
+        }
+
+        if ((cs->lastCompiledJobs().size() == 0) && (cs->jobList().size() == 0) && cs->maxJobs()) {
+            if (!cs->envs_match(job).empty()) {
+                best = cs;
+            } else {
+                bestui = cs;
+            }
+
+            break;
+        }
+
+        if (!cs->lastPickedId()
+                || ((job->id() - cs->lastPickedId()) > (20 * farm.servers.size()))) {
+            best = cs;
+            break;
+        }
+
+        CompileServer *&cur = cs->envs_match(job).empty() ? bestui : best;
+
+        if (!cur) {
+            cur = cs;
+        } else if ((cur->lastCompiledJobs().size() != 0) && (speed(cur, job) < speed(cs, job))) {
+            if (int(cs->jobList().size()) < cs->maxJobs()) {
+                cur = cs;
+            } else {
+                bestpre = cs;
+            }
+        }
+    }
+
+    return best ? best : bestui ? bestui : bestpre;
+}
+
+static void run(Farm &farm, int picks, bool use_index, const char *what)
+{
+    double elapsed = 0;
+    int failed = 0;
+
+    srandom(2);
+    double events_start = now();
+
+    for (int i = 0; i < picks; ++i) {
+        Job *job = new_job(farm);
+        double start = now();
+        CompileServer *cs = use_index ? farm.index.pick(job, farm.servers.size()) : scan(farm, job);
+        elapsed += now() - start;
+
+        if (cs) {
+            cs->appendJob(job);
+            farm.running.push_back(make_pair(cs, job));
+        } else {
+            ++failed;
+            delete job;
+        }
+
+        // A job finishes ...
+        size_t done = random() % farm.running.size();
+        CompileServer *server = farm.running[done].first;
+        server->removeJob(farm.running[done].second);
+        add_stat(server, farm.running[done].second->id());
+        delete farm.running[done].second;
+        farm.running[done] = farm.running.back();
+        farm.running.pop_back();
+
+        // ... and some server sends new stats.
+        farm.servers[random() % farm.servers.size()]->setLoad(random() % 900);
+    }
+
+    double events = now() - events_start;
+
+    printf("%-12s %10.2f us/pick %10.2f us/event (%d of %d jobs not placed)\n", what,
+           elapsed * 1000000 / picks, events * 1000000 / picks, failed, picks);
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 5000;
+    int picks = argc > 2 ? atoi(argv[2]) : 2000;
+
+    if (count <= 0 || picks <= 0) {
+        fprintf(stderr, "usage: %s [servers] [picks]\n", argv[0]);
+        return 1;
+    }
+
+    // The channels are never used, they can all share one descriptor.
+    int fd = open("/dev/null", O_RDWR);
+
+    printf("%d servers, %d picks\n", count, picks);
+
+    long rss = max_rss_kb();
+    Farm scanned;
+    build_farm(scanned, count, fd);
+    printf("farm with %zu jobs: %ld kB RSS\n", scanned.running.size(), max_rss_kb() - rss);
+    run(scanned, picks, false, "linear scan:");
+
+    Farm indexed;
+    build_farm(indexed, count, fd);
+    run(indexed, picks, true, "index:");
+    return 0;
+}